@@ -0,0 +1,66 @@
+#include <stdlib.h>
+#include "arena.h"
+
+#define MIN_BLOCK_SIZE (1 << 16)
+#define MAX_BLOCK_SIZE (1 << 24)
+
+struct arena_block {
+    arena_block *prev;
+    char data[];
+};
+
+arena *mk_arena() {
+    return mk_arena_sized(MIN_BLOCK_SIZE);
+}
+
+arena *mk_arena_sized(size_t block_size) {
+    arena *a = calloc(1, sizeof(arena));
+    a->next_size = block_size;
+    return a;
+}
+
+// starts a new block; the rest of the current one is left unused
+void *arena_grow(arena *a, size_t size) {
+    size_t block_size = a->next_size;
+    if (block_size < size)
+        block_size = size;
+    else if (a->next_size < MAX_BLOCK_SIZE)
+        a->next_size *= 2;
+    arena_block *b = malloc(sizeof(arena_block) + block_size);
+    b->prev = a->head;
+    a->head = b;
+    a->p = (char *)b->data + size;
+    a->end = (char *)b->data + block_size;
+    return b->data;
+}
+
+void arena_merge(arena *dest, arena *src) {
+    // the blocks of src are put below the head of dest, which stays the one
+    // being allocated from
+    arena_block *last = src->head;
+    if (last) {
+        while (last->prev)
+            last = last->prev;
+        if (dest->head) {
+            last->prev = dest->head->prev;
+            dest->head->prev = src->head;
+        }
+        else {
+            dest->head = src->head;
+            dest->p = src->p;
+            dest->end = src->end;
+        }
+    }
+    free(src);
+}
+
+void arena_free(arena *a) {
+    if (!a)
+        return;
+    for (arena_block *b = a->head; b;) {
+        arena_block *prev = b->prev;
+        free(b);
+        b = prev;
+    }
+    free(a);
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stddef.h>
+
+typedef struct arena_block arena_block;
+
+// a region that values are allocated from by bumping a pointer, and that is
+// only ever freed as a whole
+typedef struct {
+    // the block being allocated from, which links to the previous ones
+    arena_block *head;
+    char *p, *end;
+    size_t next_size;
+} arena;
+
+arena *mk_arena();
+
+// an arena whose first block is block_size bytes, for small documents
+arena *mk_arena_sized(size_t block_size);
+
+void *arena_grow(arena *a, size_t size);
+
+static inline void *arena_alloc(arena *a, size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    if ((size_t)(a->end - a->p) < size)
+        return arena_grow(a, size);
+    void *res = a->p;
+    a->p += size;
+    return res;
+}
+
+// gives back the space after end, which must be within the most recent
+// allocation
+static inline void arena_trim(arena *a, void *end) {
+    a->p = (char *)(((size_t)end + 7) & ~(size_t)7);
+}
+
+// moves all allocations of src into dest, and frees src
+void arena_merge(arena *dest, arena *src);
+
+void arena_free(arena *a);
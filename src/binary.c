@@ -0,0 +1,716 @@
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <setjmp.h>
+#include <inttypes.h>
+#include "binary.h"
+#include "index.h"
+
+// the children of indefinite-length containers
+#define SCRATCH_SIZE (1 << 12)
+
+// a container whose children are being decoded
+typedef struct {
+    int kind;
+    // containers of known length store their children in place as they are
+    // decoded; the others (only in CBOR) collect them on the scratch stack
+    // of the decoder, from start, until a break
+    void *children;
+    uint32_t size, count;
+    int indefinite;
+    unsigned start;
+    // the key of the member whose value is being decoded
+    char *key;
+} binary_frame;
+
+typedef struct {
+    const unsigned char *p, *end, *start;
+    int encoding;
+    arena *arena;
+    intern_table *keys;
+    // the containers enclosing the current position, innermost last
+    binary_frame *stack;
+    int depth, stack_capacity;
+    buffer scratch;
+    // only validates, without building anything; see check_binary()
+    int check;
+    // the rest of the input, if it is read a block at a time; an item that
+    // runs past a block is read on in window, and offset is that of start
+    reader *input;
+    buffer window;
+    size_t offset;
+    jmp_buf on_err;
+} decoder;
+
+int detect_encoding(const unsigned char *head, size_t len) {
+    // the tag of self-described CBOR
+    if (len >= 3 && memcmp(head, "\xd9\xd9\xf7", 3) == 0)
+        return CBOR;
+    // JSON text starts with ASCII, or with a byte order mark; so do
+    // (binary) top-level integers, which are not worth telling apart
+    if (len == 0 || head[0] < 0x80 || head[0] == 0xef)
+        return JSON_TEXT;
+    unsigned char c = head[0];
+    // a MessagePack map of up to 15 members, with a string key, or else a
+    // CBOR array of up to 15 elements
+    if (c <= 0x8f)
+        return len >= 2 && (head[1] >> 5 == 0x5 ||
+                            (head[1] >= 0xd9 && head[1] <= 0xdb))
+                   ? MSGPACK : CBOR;
+    // a CBOR array with its length in the following bytes, or of
+    // indefinite length
+    if (c >= 0x98 && c <= 0x9f)
+        return CBOR;
+    // a CBOR map; a MessagePack string at the top level is unlikely
+    if (c >= 0xa0 && c <= 0xbf)
+        return CBOR;
+    // MessagePack arrays and maps with their length in the following bytes
+    // and short arrays, which are more common than short CBOR arrays at
+    // the top level
+    if (c >= 0xdc || c <= 0x97)
+        return MSGPACK;
+    // a CBOR tag
+    return CBOR;
+}
+
+const char *encoding_name(int encoding) {
+    switch (encoding) {
+        case CBOR:
+            return "CBOR";
+        case MSGPACK:
+            return "MessagePack";
+        default:
+            return "JSON";
+    }
+}
+
+// fails at pos because of the byte there, or at the end of input
+static void fail(decoder *d, const unsigned char *pos) {
+    d->p = pos;
+    longjmp(d->on_err, 1);
+}
+
+// makes n more bytes available by reading on, if the input has them; only
+// a few bytes are ever asked for at once, since strings are checked a piece
+// at a time
+static int refill(decoder *d, uint64_t n) {
+    unsigned char carry[16];
+    size_t left = d->end - d->p;
+    if (!d->input || n > sizeof(carry) || left >= n)
+        return left >= n;
+    if (left)
+        memcpy(carry, d->p, left);
+    size_t offset = d->offset + (d->p - d->start);
+    const char *block;
+    size_t len = reader_next(d->input, &block);
+    if (len == 0)
+        return 0;
+    d->offset = offset;
+    if (left == 0 && len >= n) {
+        d->p = d->start = (const unsigned char *)block;
+        d->end = d->p + len;
+        return 1;
+    }
+    d->window.raw_size = 0;
+    buffer_append(&d->window, (const char *)carry, left);
+    do
+        buffer_append(&d->window, block, len);
+    while (d->window.raw_size < n &&
+           (len = reader_next(d->input, &block)) > 0);
+    d->p = d->start = (const unsigned char *)d->window.data;
+    d->end = d->p + d->window.raw_size;
+    return d->window.raw_size >= n;
+}
+
+// makes sure that n more bytes follow
+static inline void need(decoder *d, uint64_t n) {
+    if ((uint64_t)(d->end - d->p) < n && !refill(d, n))
+        fail(d, d->end);
+}
+
+// whether any input is left
+static inline int more(decoder *d) {
+    return d->p < d->end || refill(d, 1);
+}
+
+// reads the head of an item (at most 9 bytes) into one piece, so that
+// positions within it stay valid until it has been read
+static inline void prefetch(decoder *d) {
+    if (d->input && d->end - d->p < 9)
+        refill(d, 9);
+}
+
+static inline unsigned read_u8(decoder *d) {
+    need(d, 1);
+    return *d->p++;
+}
+
+static inline uint64_t read_be(decoder *d, int n) {
+    need(d, n);
+    uint64_t res = 0;
+    for (int i = 0; i < n; i++)
+        res = res << 8 | d->p[i];
+    d->p += n;
+    return res;
+}
+
+static inline double read_float(decoder *d) {
+    uint32_t bits = read_be(d, 4);
+    float res;
+    memcpy(&res, &bits, 4);
+    return res;
+}
+
+static inline double read_double(decoder *d) {
+    uint64_t bits = read_be(d, 8);
+    double res;
+    memcpy(&res, &bits, 8);
+    return res;
+}
+
+// https://en.wikipedia.org/wiki/Half-precision_floating-point_format
+static double read_half(decoder *d) {
+    unsigned half = read_be(d, 2);
+    int exp = half >> 10 & 0x1f;
+    unsigned mant = half & 0x3ff;
+    double res = exp == 0 ? ldexp(mant, -24)
+                 : exp == 31 ? (mant ? NAN : INFINITY)
+                 : ldexp(mant + 1024, exp - 25);
+    return half & 0x8000 ? -res : res;
+}
+
+static inline json_value mk_float_value(double number) {
+    return isfinite(number) ? mk_number_value(number) : mk_null_value();
+}
+
+static inline json_value mk_unsigned_value(uint64_t n) {
+    return n <= INT64_MAX ? mk_integer_value(n) : mk_number_value(n);
+}
+
+// -1 - n, as CBOR encodes negative integers
+static inline json_value mk_negative_value(uint64_t n) {
+    return n <= INT64_MAX ? mk_integer_value(-1 - (int64_t)n)
+                          : mk_number_value(-1.0 - (double)n);
+}
+
+// whether a short string is printable ASCII other than quotes and
+// backslashes, which most strings are; checked in place, since that takes
+// less than calling into the vectorized scans
+static inline int is_plain(const unsigned char *s, size_t len) {
+    if (len > 32)
+        return 0;
+    int res = 1;
+    for (size_t i = 0; i < len; i++)
+        res &= s[i] >= 0x20 && s[i] < 0x80 && s[i] != '\"' && s[i] != '\\';
+    return res;
+}
+
+// the text of a string, as it would appear between the quotes of JSON:
+// text without quotes, backslashes or control characters is used in place
+static json_value text_value(decoder *d, const unsigned char *s, size_t len) {
+    const char *text = (const char *)s, *end = text + len;
+    if (is_plain(s, len))
+        return mk_string_value(text, len, 0);
+    const char *bad = validate_utf8(text, end);
+    if (bad < end)
+        fail(d, (const unsigned char *)bad);
+    if (len > UINT32_MAX / 6)
+        fail(d, s);
+    const char *q = scan_string(text, end);
+    if (q == end)
+        return mk_string_value(text, len, 0);
+
+    static const char hex[] = "0123456789abcdef";
+    char *res = arena_alloc(d->arena, 6 * len), *r = res;
+    memcpy(r, text, q - text);
+    r += q - text;
+    for (; q < end; q++) {
+        unsigned char c = *q;
+        if (c == '\"' || c == '\\') {
+            *r++ = '\\';
+            *r++ = c;
+        }
+        else if (c < 0x20) {
+            memcpy(r, "\\u00", 4);
+            r[4] = hex[c >> 4];
+            r[5] = hex[c & 0xf];
+            r += 6;
+        }
+        else
+            *r++ = c;
+    }
+    arena_trim(d->arena, r);
+    return mk_string_value(res, r - res, 1);
+}
+
+// bytes, which JSON has no place for, as base64url text without padding,
+// following RFC 8949, section 6.1
+static json_value bytes_value(decoder *d, const unsigned char *s, size_t len) {
+    static const char digits[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+    if (len > UINT32_MAX / 4 * 3)
+        fail(d, s);
+    char *res = arena_alloc(d->arena, (len + 2) / 3 * 4), *r = res;
+    size_t i = 0;
+    for (; i + 3 <= len; i += 3) {
+        uint32_t w = s[i] << 16 | s[i + 1] << 8 | s[i + 2];
+        *r++ = digits[w >> 18];
+        *r++ = digits[w >> 12 & 0x3f];
+        *r++ = digits[w >> 6 & 0x3f];
+        *r++ = digits[w & 0x3f];
+    }
+    if (i < len) {
+        uint32_t w = s[i] << 16 | (i + 1 < len ? s[i + 1] << 8 : 0);
+        *r++ = digits[w >> 18];
+        *r++ = digits[w >> 12 & 0x3f];
+        if (i + 1 < len)
+            *r++ = digits[w >> 6 & 0x3f];
+    }
+    return mk_string_value(res, r - res, 0);
+}
+
+// checks a string of len bytes at the current position, a piece at a time,
+// as text_value() and bytes_value() would take it
+static void skip_string(decoder *d, uint64_t len, int text) {
+    if (len > (text ? UINT32_MAX / 6 : UINT32_MAX / 4 * 3))
+        fail(d, d->p);
+    while (len > 0) {
+        need(d, 1);
+        size_t n = len < (uint64_t)(d->end - d->p) ? len : d->end - d->p;
+        const char *piece = (const char *)d->p, *end = piece + n;
+        const char *bad = text ? validate_utf8(piece, end) : end;
+        if (bad < end) {
+            // a character cut off by the end of a block is checked again
+            // once it is whole
+            if (n == len || end - bad >= 4)
+                fail(d, (const unsigned char *)bad);
+            len -= bad - piece;
+            d->p = (const unsigned char *)bad;
+            need(d, end - bad + 1);
+            continue;
+        }
+        d->p += n;
+        len -= n;
+    }
+}
+
+// a string of len bytes at the current position
+static json_value read_string(decoder *d, uint64_t len, int text) {
+    if (d->check) {
+        skip_string(d, len, text);
+        return mk_string_value("", 0, 0);
+    }
+    need(d, len);
+    const unsigned char *s = d->p;
+    d->p += len;
+    return text ? text_value(d, s, len) : bytes_value(d, s, len);
+}
+
+// opens a container of count children, unless it is empty; returns 0 if
+// it has been opened
+static int open_container(decoder *d, int kind, uint64_t count,
+                          int indefinite, json_value *res) {
+    // every child takes up at least a byte, which rules out lengths that
+    // could not be allocated
+    if (!indefinite && (count > UINT32_MAX ||
+                        (!d->input && count > (uint64_t)(d->end - d->p) /
+                                                  (kind == OBJECT ? 2 : 1))))
+        fail(d, d->end);
+    if (!indefinite && count == 0) {
+        buffer empty = { NULL, 0, 0 };
+        *res = kind == OBJECT ? mk_object_value(empty) : mk_array_value(empty);
+        return 1;
+    }
+    if (d->depth == d->stack_capacity) {
+        d->stack_capacity = d->stack_capacity ? 2 * d->stack_capacity : 16;
+        d->stack = realloc(d->stack,
+                           d->stack_capacity * sizeof(binary_frame));
+    }
+    binary_frame *top = &d->stack[d->depth++];
+    top->kind = kind;
+    top->size = 0;
+    top->count = count;
+    top->indefinite = indefinite;
+    top->start = d->scratch.raw_size;
+    top->key = NULL;
+    top->children = indefinite || d->check ? NULL
+        : arena_alloc(d->arena, count * (kind == OBJECT ? sizeof(json_member)
+                                                        : sizeof(json_value)));
+    return 0;
+}
+
+static json_value close_container(decoder *d) {
+    binary_frame *top = &d->stack[--d->depth];
+    if (d->check) {
+        buffer empty = { NULL, 0, 0 };
+        return top->kind == OBJECT ? mk_object_value(empty)
+                                   : mk_array_value(empty);
+    }
+    if (!top->indefinite)
+        return (json_value){ .kind = top->kind, .size = top->count,
+                             .elements = top->children };
+    buffer children = d->scratch;
+    children.data += top->start;
+    children.raw_size -= top->start;
+    d->scratch.raw_size = top->start;
+    buffer res = { NULL, children.raw_size, children.raw_size };
+    if (res.raw_size) {
+        res.data = arena_alloc(d->arena, res.raw_size);
+        memcpy(res.data, children.data, res.raw_size);
+    }
+    return top->kind == OBJECT ? mk_object_value(res) : mk_array_value(res);
+}
+
+static void add_child(decoder *d, binary_frame *top, json_value child) {
+    if (d->check)
+        top->size++;
+    else if (top->indefinite && top->kind == OBJECT)
+        object_append(&d->scratch, (json_member){ top->key, child });
+    else if (top->indefinite)
+        array_append(&d->scratch, child);
+    else if (top->kind == OBJECT)
+        ((json_member *)top->children)[top->size++] =
+            (json_member){ top->key, child };
+    else
+        ((json_value *)top->children)[top->size++] = child;
+}
+
+// the argument that follows the initial byte of a CBOR item, given its
+// additional information; -1 stands for indefinite length
+static inline uint64_t cbor_argument(decoder *d, unsigned info) {
+    if (info < 24)
+        return info;
+    if (info <= 27)
+        return read_be(d, 1 << (info - 24));
+    if (info == 31)
+        return -1;
+    fail(d, d->p - 1);
+    return 0;
+}
+
+// the chunks of a CBOR string of indefinite length, joined on the scratch
+// stack
+static json_value cbor_chunks(decoder *d, int major) {
+    unsigned start = d->scratch.raw_size;
+    for (;;) {
+        prefetch(d);
+        const unsigned char *chunk = d->p;
+        unsigned c = read_u8(d);
+        if (c == 0xff)
+            break;
+        uint64_t len = cbor_argument(d, c & 0x1f);
+        if (c >> 5 != major || len == (uint64_t)-1)
+            fail(d, chunk);
+        // each chunk is checked on its own, as RFC 8949 requires of text
+        if (d->check) {
+            skip_string(d, len, major == 3);
+            continue;
+        }
+        need(d, len);
+        buffer_append(&d->scratch, (const char *)d->p, len);
+        d->p += len;
+    }
+    if (d->check)
+        return mk_string_value("", 0, 0);
+    size_t len = d->scratch.raw_size - start;
+    unsigned char *s = arena_alloc(d->arena, len);
+    memcpy(s, d->scratch.data + start, len);
+    d->scratch.raw_size = start;
+    return major == 3 ? text_value(d, s, len) : bytes_value(d, s, len);
+}
+
+// decodes a CBOR item into res, unless it opens a container that has
+// children; returns 0 if it does
+static int cbor_item(decoder *d, json_value *res) {
+    for (;;) {
+        prefetch(d);
+        const unsigned char *item = d->p;
+        unsigned c = read_u8(d);
+        unsigned major = c >> 5, info = c & 0x1f;
+        if (major == 7) {
+            switch (info) {
+                case 20:
+                    *res = mk_false_value();
+                    return 1;
+                case 21:
+                    *res = mk_true_value();
+                    return 1;
+                case 25:
+                    *res = mk_float_value(read_half(d));
+                    return 1;
+                case 26:
+                    *res = mk_float_value(read_float(d));
+                    return 1;
+                case 27:
+                    *res = mk_float_value(read_double(d));
+                    return 1;
+                case 24:
+                    read_u8(d);
+                    // fall through
+                default:
+                    // null, undefined and other simple values
+                    if (info > 27)
+                        fail(d, item);
+                    *res = mk_null_value();
+                    return 1;
+            }
+        }
+        uint64_t arg = cbor_argument(d, info);
+        int indefinite = arg == (uint64_t)-1 && info == 31;
+        switch (major) {
+            case 0:
+                if (indefinite)
+                    fail(d, item);
+                *res = mk_unsigned_value(arg);
+                return 1;
+            case 1:
+                if (indefinite)
+                    fail(d, item);
+                *res = mk_negative_value(arg);
+                return 1;
+            case 2:
+            case 3:
+                *res = indefinite ? cbor_chunks(d, major)
+                                  : read_string(d, arg, major == 3);
+                return 1;
+            case 4:
+                return open_container(d, ARRAY, arg, indefinite, res);
+            case 5:
+                return open_container(d, OBJECT, arg, indefinite, res);
+            default:
+                // tags are left out, and only their content is kept
+                if (indefinite)
+                    fail(d, item);
+        }
+    }
+}
+
+// decodes a MessagePack item, like cbor_item()
+static int msgpack_item(decoder *d, json_value *res) {
+    prefetch(d);
+    const unsigned char *item = d->p;
+    unsigned c = read_u8(d);
+    if (c <= 0x7f) {
+        *res = mk_integer_value(c);
+        return 1;
+    }
+    if (c >= 0xe0) {
+        *res = mk_integer_value((int8_t)c);
+        return 1;
+    }
+    if (c <= 0x8f)
+        return open_container(d, OBJECT, c & 0xf, 0, res);
+    if (c <= 0x9f)
+        return open_container(d, ARRAY, c & 0xf, 0, res);
+    if (c <= 0xbf) {
+        *res = read_string(d, c & 0x1f, 1);
+        return 1;
+    }
+    switch (c) {
+        case 0xc0:
+            *res = mk_null_value();
+            return 1;
+        case 0xc2:
+            *res = mk_false_value();
+            return 1;
+        case 0xc3:
+            *res = mk_true_value();
+            return 1;
+        case 0xc4:
+        case 0xc5:
+        case 0xc6:
+            *res = read_string(d, read_be(d, 1 << (c - 0xc4)), 0);
+            return 1;
+        // extensions, whose type is left out
+        case 0xc7:
+        case 0xc8:
+        case 0xc9: {
+            uint64_t len = read_be(d, 1 << (c - 0xc7));
+            read_u8(d);
+            *res = read_string(d, len, 0);
+            return 1;
+        }
+        case 0xca:
+            *res = mk_float_value(read_float(d));
+            return 1;
+        case 0xcb:
+            *res = mk_float_value(read_double(d));
+            return 1;
+        case 0xcc:
+        case 0xcd:
+        case 0xce:
+        case 0xcf:
+            *res = mk_unsigned_value(read_be(d, 1 << (c - 0xcc)));
+            return 1;
+        case 0xd0:
+            *res = mk_integer_value((int8_t)read_be(d, 1));
+            return 1;
+        case 0xd1:
+            *res = mk_integer_value((int16_t)read_be(d, 2));
+            return 1;
+        case 0xd2:
+            *res = mk_integer_value((int32_t)read_be(d, 4));
+            return 1;
+        case 0xd3:
+            *res = mk_integer_value((int64_t)read_be(d, 8));
+            return 1;
+        case 0xd4:
+        case 0xd5:
+        case 0xd6:
+        case 0xd7:
+        case 0xd8:
+            read_u8(d);
+            *res = read_string(d, 1 << (c - 0xd4), 0);
+            return 1;
+        case 0xd9:
+        case 0xda:
+        case 0xdb:
+            *res = read_string(d, read_be(d, 1 << (c - 0xd9)), 1);
+            return 1;
+        case 0xdc:
+        case 0xdd:
+            return open_container(d, ARRAY, read_be(d, 2 << (c - 0xdc)), 0,
+                                  res);
+        case 0xde:
+        case 0xdf:
+            return open_container(d, OBJECT, read_be(d, 2 << (c - 0xde)), 0,
+                                  res);
+        default:
+            // 0xc1 is never used
+            fail(d, item);
+            return 0;
+    }
+}
+
+static inline int read_item(decoder *d, json_value *res) {
+    return d->encoding == CBOR ? cbor_item(d, res) : msgpack_item(d, res);
+}
+
+// keys are strings, or else integers or byte strings, which are converted
+// to text
+static char *read_key(decoder *d) {
+    prefetch(d);
+    const unsigned char *item = d->p;
+    json_value key;
+    if (!read_item(d, &key))
+        fail(d, item);
+    if (d->check && (key.kind == STRING || key.kind == INTEGER))
+        return NULL;
+    if (key.kind == STRING && key.escaped) {
+        char *decoded = buffer_reserve(&d->scratch, key.size + 1);
+        return intern(d->keys, decoded,
+                      unescape(string_data(&key), key.size, decoded));
+    }
+    if (key.kind == STRING)
+        return intern(d->keys, string_data(&key), key.size);
+    if (key.kind == INTEGER) {
+        char text[24];
+        return intern(d->keys, text,
+                      sprintf(text, "%" PRId64, key.integer));
+    }
+    fail(d, item);
+    return NULL;
+}
+
+// containers are kept on an explicit stack rather than decoded
+// recursively, so that the nesting depth is only limited by memory
+static json_value decode_item(decoder *d) {
+    for (;;) {
+        json_value res;
+        binary_frame *top = d->depth ? &d->stack[d->depth - 1] : NULL;
+        if (top && top->indefinite && more(d) && *d->p == 0xff) {
+            d->p++;
+            res = close_container(d);
+        }
+        else {
+            if (top && top->kind == OBJECT)
+                top->key = read_key(d);
+            if (!read_item(d, &res))
+                continue;
+        }
+
+        // res is complete: add it to its container, and complete any
+        // containers that end with it
+        for (;;) {
+            if (d->depth == 0)
+                return res;
+            top = &d->stack[d->depth - 1];
+            add_child(d, top, res);
+            if (top->indefinite || top->size < top->count)
+                break;
+            res = close_container(d);
+        }
+    }
+}
+
+// where and why decoding failed
+static parse_result binary_error(decoder *d) {
+    parse_result pr = { .success = 0 };
+    pr.error.kind = BINARY_ERROR;
+    pr.error.offset = d->offset + (d->p - d->start);
+    pr.error.tok = d->p < d->end ? *d->p : EOF;
+    pr.error.line = pr.error.col = 0;
+    pr.error.excerpt_len = 0;
+    return pr;
+}
+
+parse_result parse_binary(const char *data, size_t len, int encoding) {
+    decoder d = { .p = (const unsigned char *)data,
+                  .end = (const unsigned char *)data + len,
+                  .start = (const unsigned char *)data,
+                  .encoding = encoding };
+    d.arena = mk_arena();
+    d.keys = mk_intern_table(d.arena);
+    d.scratch = mk_buffer(SCRATCH_SIZE);
+    buffer values = mk_buffer(SCRATCH_SIZE);
+    parse_result pr = { .success = 1 };
+    if (setjmp(d.on_err)) {
+        pr = binary_error(&d);
+        arena_free(d.arena);
+    }
+    else {
+        pr.res = decode_item(&d);
+        // a sequence of values, such as a log of records
+        if (d.p < d.end) {
+            array_append(&values, pr.res);
+            while (d.p < d.end)
+                array_append(&values, decode_item(&d));
+            buffer res = { arena_alloc(d.arena, values.raw_size),
+                           values.raw_size, values.raw_size };
+            memcpy(res.data, values.data, values.raw_size);
+            pr.res = mk_array_value(res);
+        }
+        pr.arena = d.arena;
+    }
+    free(d.stack);
+    buffer_free(&d.scratch);
+    buffer_free(&values);
+    return pr;
+}
+
+parse_result check_binary(const char *data, size_t len, reader *input,
+                          int encoding, size_t *consumed) {
+    decoder d = { .p = (const unsigned char *)data,
+                  .end = (const unsigned char *)data + len,
+                  .start = (const unsigned char *)data,
+                  .encoding = encoding, .check = 1 };
+    if (!data) {
+        d.input = input;
+        d.p = d.end = d.start = NULL;
+    }
+    d.window = mk_buffer(SCRATCH_SIZE);
+    parse_result pr = { .success = 1 };
+    if (setjmp(d.on_err))
+        pr = binary_error(&d);
+    else {
+        // a sequence of values, such as a log of records
+        do
+            decode_item(&d);
+        while (more(&d));
+    }
+    if (consumed)
+        *consumed = d.offset + (d.p - d.start);
+    free(d.stack);
+    buffer_free(&d.window);
+    return pr;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stddef.h>
+#include "json.h"
+#include "parse.h"
+
+// encodings of documents, as recognized by their extension or first bytes
+enum {
+    JSON_TEXT,
+    CBOR,
+    MSGPACK
+};
+
+#define ENCODING_MAGIC_SIZE 3
+
+// the likely encoding of an input starting with the len bytes at head;
+// binary encodings other than self-described CBOR can only be guessed from
+// their first bytes, so the guess may turn out wrong
+int detect_encoding(const unsigned char *head, size_t len);
+
+const char *encoding_name(int encoding);
+
+// decodes the len bytes at data, in a binary encoding, into the same kind of
+// document that parse_json_buf() builds: byte strings become base64url text,
+// and numbers that JSON cannot hold (NaN, infinities) become null; a
+// sequence of several values is decoded as an array of them; errors are
+// reported as BINARY_ERROR; the strings of the result refer to data, which
+// must outlive it
+parse_result parse_binary(const char *data, size_t len, int encoding);
+
+// only validates the len bytes at data (or the blocks of input, if data is
+// NULL) as parse_binary() would decode them, in memory that depends on
+// nesting depth but not on the size of the input; the number of bytes read
+// is stored in consumed, if not NULL
+parse_result check_binary(const char *data, size_t len, reader *input,
+                          int encoding, size_t *consumed);
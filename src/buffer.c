@@ -29,9 +29,11 @@ void string_clear(buffer *buf) {
     buf->raw_size = 1;
 }
 
+// the capacity is doubled until new_size fits, so that appending stays
+// amortized constant time
 static inline void buffer_request_size(buffer *buf, unsigned new_size) {
-    if (new_size * 2 >= buf->capacity) {
-        while (new_size * 2 >= buf->capacity)
+    if (new_size > buf->capacity) {
+        while (new_size > buf->capacity)
             buf->capacity *= 2;
         buf->data = (char *)realloc(buf->data, buf->capacity);
     }
@@ -51,6 +53,11 @@ void buffer_append(buffer *buf, const char *data, unsigned len) {
     buf->raw_size = new_size;
 }
 
+char *buffer_reserve(buffer *buf, unsigned len) {
+    buffer_request_size(buf, buf->raw_size + len);
+    return buf->data + buf->raw_size;
+}
+
 // assumes that the last char is '\0' and may be overwritten
 static inline unsigned string_space(buffer *buf, unsigned maxlen) {
     unsigned space = buf->capacity - buf->raw_size + 1;
@@ -87,7 +94,7 @@ int string_nprintf(buffer *buf, unsigned maxlen, const char *fmt, ...) {
     va_end(saved_args);
     buf->raw_size += nw;
 
-    assert(buf->raw_size * 2 < buf->capacity);
+    assert(buf->raw_size <= buf->capacity);
     assert(buf->data[buf->raw_size - 1] == '\0');
     return nw;
 }
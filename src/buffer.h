@@ -20,6 +20,10 @@ void buffer_putchar(buffer *buf, char c);
 
 void buffer_append(buffer *buf, const char *data, unsigned len);
 
+// room for len bytes past the end of buf, for temporary use; they are not
+// added to it
+char *buffer_reserve(buffer *buf, unsigned len);
+
 int string_nprintf(buffer *buf, unsigned maxlen, const char *fmt, ...);
 
 void buffer_compact(buffer *buf);
@@ -0,0 +1,234 @@
+// for F_SETPIPE_SZ
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <zlib.h>
+#include <lzma.h>
+#include "decompress.h"
+
+#define CHUNK_SIZE (1 << 16)
+// large enough for decompression to run ahead of parsing
+#define PIPE_SIZE (1 << 20)
+
+struct decompressor {
+    int format;
+    // the compressed file
+    int in;
+    // the write end of the pipe, for decompressors running on a thread
+    int out;
+    FILE *output;
+    pthread_t thread;
+    pid_t pid;
+    // compressed bytes read so far; read and written atomically
+    size_t consumed;
+    int failed;
+};
+
+int detect_compression(const unsigned char *head, size_t len) {
+    if (len >= 2 && head[0] == 0x1f && head[1] == 0x8b)
+        return GZIP;
+    if (len >= 6 && memcmp(head, "\xfd" "7zXZ\0", 6) == 0)
+        return XZ;
+    if (len >= 4 && memcmp(head, "\x28\xb5\x2f\xfd", 4) == 0)
+        return ZSTD;
+    return UNCOMPRESSED;
+}
+
+const char *compression_name(int format) {
+    switch (format) {
+        case GZIP:
+            return "gzip";
+        case XZ:
+            return "xz";
+        case ZSTD:
+            return "zstd";
+        default:
+            return "uncompressed";
+    }
+}
+
+static ssize_t read_input(decompressor *d, unsigned char *buf) {
+    ssize_t n = read(d->in, buf, CHUNK_SIZE);
+    if (n > 0)
+        __atomic_add_fetch(&d->consumed, n, __ATOMIC_RELAXED);
+    return n;
+}
+
+// returns 0 once the reader has gone away
+static int write_output(decompressor *d, const unsigned char *buf,
+                        size_t len) {
+    while (len > 0) {
+        ssize_t n = write(d->out, buf, len);
+        if (n < 0)
+            return 0;
+        buf += n;
+        len -= n;
+    }
+    return 1;
+}
+
+// concatenated gzip members are decompressed one after the other
+static int inflate_gzip(decompressor *d) {
+    unsigned char in[CHUNK_SIZE], out[CHUNK_SIZE];
+    z_stream z = { 0 };
+    // 32 selects automatic detection of the gzip header
+    if (inflateInit2(&z, 15 + 32) != Z_OK)
+        return 0;
+    // whether the last member has been completed
+    int complete = 0, ok = 1;
+    for (;;) {
+        if (z.avail_in == 0) {
+            ssize_t n = read_input(d, in);
+            if (n <= 0) {
+                ok = n == 0 && complete;
+                break;
+            }
+            z.next_in = in;
+            z.avail_in = n;
+        }
+        z.next_out = out;
+        z.avail_out = CHUNK_SIZE;
+        int ret = inflate(&z, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+            ok = 0;
+            break;
+        }
+        if (z.avail_out < CHUNK_SIZE)
+            complete = 0;
+        if (!write_output(d, out, CHUNK_SIZE - z.avail_out))
+            break;
+        if (ret == Z_STREAM_END) {
+            complete = 1;
+            inflateReset(&z);
+        }
+    }
+    inflateEnd(&z);
+    return ok;
+}
+
+static int decode_xz(decompressor *d) {
+    unsigned char in[CHUNK_SIZE], out[CHUNK_SIZE];
+    lzma_stream s = LZMA_STREAM_INIT;
+    if (lzma_stream_decoder(&s, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK)
+        return 0;
+    lzma_action action = LZMA_RUN;
+    int ok = 1;
+    for (;;) {
+        if (s.avail_in == 0 && action == LZMA_RUN) {
+            ssize_t n = read_input(d, in);
+            if (n < 0) {
+                ok = 0;
+                break;
+            }
+            if (n == 0)
+                action = LZMA_FINISH;
+            s.next_in = in;
+            s.avail_in = n;
+        }
+        s.next_out = out;
+        s.avail_out = CHUNK_SIZE;
+        lzma_ret ret = lzma_code(&s, action);
+        if (!write_output(d, out, CHUNK_SIZE - s.avail_out))
+            break;
+        if (ret == LZMA_STREAM_END)
+            break;
+        if (ret != LZMA_OK) {
+            ok = 0;
+            break;
+        }
+    }
+    lzma_end(&s);
+    return ok;
+}
+
+static void *decompress_run(void *arg) {
+    decompressor *d = arg;
+    int ok = d->format == GZIP ? inflate_gzip(d) : decode_xz(d);
+    __atomic_store_n(&d->failed, !ok, __ATOMIC_RELAXED);
+    // the reader sees the end of input
+    close(d->out);
+    return NULL;
+}
+
+// there is no zstd library to build against, so the zstd tool is run
+// instead, reading the file directly
+static int spawn_zstd(decompressor *d, int out) {
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, d->in, STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, out, STDOUT_FILENO);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null",
+                                     O_WRONLY, 0);
+    char *argv[] = { "zstd", "-dcq", NULL };
+    extern char **environ;
+    int err = posix_spawnp(&d->pid, "zstd", &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    return err == 0;
+}
+
+decompressor *decompress_start(int fd, int format) {
+    int fds[2];
+    if (pipe(fds) < 0)
+        return NULL;
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETPIPE_SZ, PIPE_SIZE);
+    decompressor *d = calloc(1, sizeof(decompressor));
+    d->format = format;
+    d->in = fd;
+    d->out = fds[1];
+    d->output = fdopen(fds[0], "r");
+
+    int started;
+    if (format == ZSTD) {
+        started = spawn_zstd(d, fds[1]);
+        close(fds[1]);
+    }
+    else
+        started = pthread_create(&d->thread, NULL, decompress_run, d) == 0;
+    if (!started) {
+        if (format != ZSTD)
+            close(fds[1]);
+        fclose(d->output);
+        close(fd);
+        free(d);
+        return NULL;
+    }
+    return d;
+}
+
+FILE *decompress_output(decompressor *d) {
+    return d->output;
+}
+
+size_t decompress_consumed(decompressor *d) {
+    // the zstd process advances the shared file offset
+    if (d->format == ZSTD) {
+        off_t pos = lseek(d->in, 0, SEEK_CUR);
+        return pos < 0 ? 0 : pos;
+    }
+    return __atomic_load_n(&d->consumed, __ATOMIC_RELAXED);
+}
+
+int decompress_finish(decompressor *d) {
+    // a decompressor that is still writing fails with EPIPE and stops
+    fclose(d->output);
+    int ok;
+    if (d->format == ZSTD) {
+        int status;
+        ok = waitpid(d->pid, &status, 0) == d->pid && WIFEXITED(status) &&
+             WEXITSTATUS(status) == 0;
+    }
+    else {
+        pthread_join(d->thread, NULL);
+        ok = !d->failed;
+    }
+    close(d->in);
+    free(d);
+    return ok;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdio.h>
+#include <stddef.h>
+
+// compression formats, as recognized by their magic bytes
+enum {
+    UNCOMPRESSED,
+    GZIP,
+    XZ,
+    ZSTD
+};
+
+#define MAGIC_SIZE 6
+
+// the format of a file starting with the len bytes at head
+int detect_compression(const unsigned char *head, size_t len);
+
+const char *compression_name(int format);
+
+typedef struct decompressor decompressor;
+
+// starts decompressing the file fd, which it takes ownership of, on a
+// separate thread (or, for zstd, in a separate process); the decompressed
+// contents are read from decompress_output(); returns NULL on failure
+decompressor *decompress_start(int fd, int format);
+
+// the read end of the pipe carrying the decompressed contents
+FILE *decompress_output(decompressor *d);
+
+// the number of compressed bytes read so far; may be called from any thread
+size_t decompress_consumed(decompressor *d);
+
+// closes the output, stops decompressing and releases d; returns 0 if the
+// input turned out to be corrupt or truncated
+int decompress_finish(decompressor *d);
@@ -0,0 +1,532 @@
+#include <stdlib.h>
+#include <string.h>
+#include "index.h"
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+// character classes of one 64-byte chunk, one bit per byte
+typedef struct {
+    uint64_t quote, backslash, op, ws;
+} chunk_masks;
+
+// newlines and UTF-8 lead bytes (the bytes that start a character) of one
+// 64-byte chunk, one bit per byte
+typedef struct {
+    uint64_t newline, lead;
+} position_masks;
+
+static void classify_scalar(const unsigned char *s, chunk_masks *m) {
+    *m = (chunk_masks){ 0 };
+    for (int i = 0; i < 64; i++) {
+        uint64_t bit = (uint64_t)1 << i;
+        switch (s[i]) {
+            case '\"':
+                m->quote |= bit;
+                break;
+            case '\\':
+                m->backslash |= bit;
+                break;
+            case '{': case '}': case '[': case ']': case ':': case ',':
+                m->op |= bit;
+                break;
+            case ' ': case '\n': case '\r': case '\t':
+                m->ws |= bit;
+                break;
+        }
+    }
+}
+
+static void find_lines_scalar(const unsigned char *s, position_masks *m) {
+    *m = (position_masks){ 0 };
+    for (int i = 0; i < 64; i++) {
+        uint64_t bit = (uint64_t)1 << i;
+        if (s[i] == '\n')
+            m->newline |= bit;
+        if ((s[i] & 0xc0) != 0x80)
+            m->lead |= bit;
+    }
+}
+
+#ifdef __x86_64__
+static inline uint64_t eq_sse2(__m128i v[4], char c) {
+    __m128i cv = _mm_set1_epi8(c);
+    uint64_t r = 0;
+    for (int i = 0; i < 4; i++)
+        r |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v[i], cv))
+             << (16 * i);
+    return r;
+}
+
+static void classify_sse2(const unsigned char *s, chunk_masks *m) {
+    __m128i v[4];
+    for (int i = 0; i < 4; i++)
+        v[i] = _mm_loadu_si128((const __m128i *)(s + 16 * i));
+    m->quote = eq_sse2(v, '\"');
+    m->backslash = eq_sse2(v, '\\');
+    m->op = eq_sse2(v, '{') | eq_sse2(v, '}') | eq_sse2(v, '[') |
+            eq_sse2(v, ']') | eq_sse2(v, ':') | eq_sse2(v, ',');
+    m->ws = eq_sse2(v, ' ') | eq_sse2(v, '\n') | eq_sse2(v, '\r') |
+            eq_sse2(v, '\t');
+}
+
+static void find_lines_sse2(const unsigned char *s, position_masks *m) {
+    __m128i v[4], c[4];
+    for (int i = 0; i < 4; i++) {
+        v[i] = _mm_loadu_si128((const __m128i *)(s + 16 * i));
+        c[i] = _mm_and_si128(v[i], _mm_set1_epi8((char)0xc0));
+    }
+    m->newline = eq_sse2(v, '\n');
+    m->lead = ~eq_sse2(c, (char)0x80);
+}
+
+__attribute__((target("avx2")))
+static inline uint64_t eq_avx2(__m256i lo, __m256i hi, char c) {
+    __m256i cv = _mm256_set1_epi8(c);
+    uint32_t l = _mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, cv));
+    uint32_t h = _mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, cv));
+    return (uint64_t)h << 32 | l;
+}
+
+__attribute__((target("avx2")))
+static void classify_avx2(const unsigned char *s, chunk_masks *m) {
+    __m256i lo = _mm256_loadu_si256((const __m256i *)s);
+    __m256i hi = _mm256_loadu_si256((const __m256i *)(s + 32));
+    m->quote = eq_avx2(lo, hi, '\"');
+    m->backslash = eq_avx2(lo, hi, '\\');
+    m->op = eq_avx2(lo, hi, '{') | eq_avx2(lo, hi, '}') |
+            eq_avx2(lo, hi, '[') | eq_avx2(lo, hi, ']') |
+            eq_avx2(lo, hi, ':') | eq_avx2(lo, hi, ',');
+    m->ws = eq_avx2(lo, hi, ' ') | eq_avx2(lo, hi, '\n') |
+            eq_avx2(lo, hi, '\r') | eq_avx2(lo, hi, '\t');
+}
+
+__attribute__((target("avx2")))
+static void find_lines_avx2(const unsigned char *s, position_masks *m) {
+    __m256i lo = _mm256_loadu_si256((const __m256i *)s);
+    __m256i hi = _mm256_loadu_si256((const __m256i *)(s + 32));
+    __m256i top = _mm256_set1_epi8((char)0xc0);
+    m->newline = eq_avx2(lo, hi, '\n');
+    m->lead = ~eq_avx2(_mm256_and_si256(lo, top), _mm256_and_si256(hi, top),
+                       (char)0x80);
+}
+#endif
+
+static const char *scan_string_scalar(const char *p, const char *end) {
+    for (; p < end; p++) {
+        unsigned char c = *p;
+        if (c == '\"' || c == '\\' || c < 0x20)
+            return p;
+    }
+    return end;
+}
+
+#ifdef __x86_64__
+static const char *scan_string_sse2(const char *p, const char *end) {
+    const __m128i quote = _mm_set1_epi8('\"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control = _mm_set1_epi8(0x1f);
+    for (; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        __m128i m = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)),
+            _mm_cmpeq_epi8(_mm_min_epu8(v, control), v));
+        int bits = _mm_movemask_epi8(m);
+        if (bits)
+            return p + __builtin_ctz(bits);
+    }
+    return scan_string_scalar(p, end);
+}
+
+__attribute__((target("avx2")))
+static const char *scan_string_avx2(const char *p, const char *end) {
+    const __m256i quote = _mm256_set1_epi8('\"');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    const __m256i control = _mm256_set1_epi8(0x1f);
+    for (; end - p >= 32; p += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        __m256i m = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, quote),
+                            _mm256_cmpeq_epi8(v, backslash)),
+            _mm256_cmpeq_epi8(_mm256_min_epu8(v, control), v));
+        uint32_t bits = _mm256_movemask_epi8(m);
+        if (bits)
+            return p + __builtin_ctz(bits);
+    }
+    return scan_string_sse2(p, end);
+}
+#endif
+
+// the length of the valid UTF-8 sequence at p, or 0 if it is invalid or
+// cut off by end; see https://www.unicode.org/versions/latest/ch03.pdf,
+// table 3-7
+static inline int utf8_sequence(const unsigned char *p,
+                                const unsigned char *end) {
+    unsigned char c = p[0];
+    int len;
+    unsigned char lo = 0x80, hi = 0xbf;
+    if (c < 0x80)
+        return 1;
+    else if (c < 0xc2)
+        return 0;
+    else if (c < 0xe0)
+        len = 2;
+    else if (c < 0xf0) {
+        len = 3;
+        // overlong, and surrogates
+        if (c == 0xe0)
+            lo = 0xa0;
+        else if (c == 0xed)
+            hi = 0x9f;
+    }
+    else if (c < 0xf5) {
+        len = 4;
+        // overlong, and beyond U+10FFFF
+        if (c == 0xf0)
+            lo = 0x90;
+        else if (c == 0xf4)
+            hi = 0x8f;
+    }
+    else
+        return 0;
+    if (end - p < len || p[1] < lo || p[1] > hi)
+        return 0;
+    for (int i = 2; i < len; i++)
+        if ((p[i] & 0xc0) != 0x80)
+            return 0;
+    return len;
+}
+
+static const char *validate_utf8_scalar(const char *p, const char *end) {
+    const unsigned char *q = (const unsigned char *)p;
+    while (q < (const unsigned char *)end) {
+        int len = utf8_sequence(q, (const unsigned char *)end);
+        if (!len)
+            break;
+        q += len;
+    }
+    return (const char *)q;
+}
+
+#ifdef __x86_64__
+// ASCII is skipped 16 bytes at a time
+static const char *validate_utf8_sse2(const char *p, const char *end) {
+    for (;;) {
+        while (end - p >= 16 &&
+               !_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)p)))
+            p += 16;
+        if (end - p < 16)
+            return validate_utf8_scalar(p, end);
+        // up to the end of the sequence that covers the last byte of the
+        // block
+        const char *q = p + 16;
+        while (q < end && ((unsigned char)*q & 0xc0) == 0x80 && q - p < 19)
+            q++;
+        const char *bad = validate_utf8_scalar(p, q);
+        if (bad < q)
+            return bad;
+        p = q;
+    }
+}
+
+// the lookup algorithm of Keiser and Lemire, "Validating UTF-8 in less than
+// one instruction per byte" (2021): each byte is checked against the
+// classes of the byte before it, and the lengths of sequences against the
+// continuations that follow their leads; blocks with an error are looked
+// at again by the scalar version, to find where the error is
+__attribute__((target("avx2")))
+static inline __m256i prev_bytes(__m256i input, __m256i prev, int n) {
+    __m256i shifted = _mm256_permute2x128_si256(prev, input, 0x21);
+    switch (n) {
+        case 1:
+            return _mm256_alignr_epi8(input, shifted, 15);
+        case 2:
+            return _mm256_alignr_epi8(input, shifted, 14);
+        default:
+            return _mm256_alignr_epi8(input, shifted, 13);
+    }
+}
+
+#define TOO_SHORT (1 << 0)
+#define TOO_LONG (1 << 1)
+#define OVERLONG_3 (1 << 2)
+#define TOO_LARGE (1 << 3)
+#define SURROGATE (1 << 4)
+#define OVERLONG_2 (1 << 5)
+#define TOO_LARGE_1000 (1 << 6)
+#define OVERLONG_4 (1 << 6)
+#define TWO_CONTS (1 << 7)
+#define CARRY (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+#define TABLE16(...) _mm256_setr_epi8(__VA_ARGS__, __VA_ARGS__)
+
+__attribute__((target("avx2")))
+static __m256i utf8_errors(__m256i input, __m256i prev_input) {
+    const __m256i low_nibble = _mm256_set1_epi8(0x0f);
+    __m256i prev1 = prev_bytes(input, prev_input, 1);
+    __m256i byte_1_high = _mm256_shuffle_epi8(TABLE16(
+        TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+        TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+        TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+        TOO_SHORT | OVERLONG_2,
+        TOO_SHORT,
+        TOO_SHORT | OVERLONG_3 | SURROGATE,
+        TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4),
+        _mm256_and_si256(_mm256_srli_epi16(prev1, 4), low_nibble));
+    __m256i byte_1_low = _mm256_shuffle_epi8(TABLE16(
+        CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+        CARRY | OVERLONG_2,
+        CARRY,
+        CARRY,
+        CARRY | TOO_LARGE,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000),
+        _mm256_and_si256(prev1, low_nibble));
+    __m256i byte_2_high = _mm256_shuffle_epi8(TABLE16(
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 |
+            OVERLONG_4,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT),
+        _mm256_and_si256(_mm256_srli_epi16(input, 4), low_nibble));
+    __m256i special = _mm256_and_si256(_mm256_and_si256(byte_1_high,
+                                                        byte_1_low),
+                                       byte_2_high);
+
+    // the third and fourth bytes of sequences must be continuations, and
+    // only those, along with the second bytes flagged above, may be
+    __m256i prev2 = prev_bytes(input, prev_input, 2);
+    __m256i prev3 = prev_bytes(input, prev_input, 3);
+    __m256i is_third = _mm256_subs_epu8(prev2, _mm256_set1_epi8(0xe0 - 0x80));
+    __m256i is_fourth = _mm256_subs_epu8(prev3, _mm256_set1_epi8(0xf0 - 0x80));
+    __m256i must_continue = _mm256_and_si256(
+        _mm256_or_si256(is_third, is_fourth), _mm256_set1_epi8((char)0x80));
+    return _mm256_xor_si256(must_continue, special);
+}
+
+// nonzero where a block ends within a sequence
+__attribute__((target("avx2")))
+static inline __m256i utf8_incomplete(__m256i input) {
+    const __m256i max = _mm256_setr_epi8(
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        0xf0 - 1, 0xe0 - 1, 0xc0 - 1);
+    return _mm256_subs_epu8(input, max);
+}
+
+__attribute__((target("avx2")))
+static const char *validate_utf8_avx2(const char *p, const char *end) {
+    const char *start = p;
+    __m256i prev = _mm256_setzero_si256(), incomplete = prev;
+    __m256i error = prev;
+    for (; end - p >= 32; p += 32) {
+        __m256i input = _mm256_loadu_si256((const __m256i *)p);
+        if (!_mm256_movemask_epi8(input))
+            error = _mm256_or_si256(error, incomplete);
+        else {
+            error = _mm256_or_si256(error, utf8_errors(input, prev));
+            incomplete = utf8_incomplete(input);
+        }
+        prev = input;
+        if (!_mm256_testz_si256(error, error))
+            break;
+    }
+    if (end - p < 32 && _mm256_testz_si256(error, error)) {
+        // the last block is padded with ASCII
+        char tail[32] = { 0 };
+        memcpy(tail, p, end - p);
+        __m256i input = _mm256_loadu_si256((const __m256i *)tail);
+        error = _mm256_or_si256(utf8_errors(input, prev),
+                                utf8_incomplete(input));
+        if (_mm256_testz_si256(error, error))
+            return end;
+    }
+    // the error may be in a sequence that started in the previous block
+    const char *from = p;
+    for (int i = 1; i <= 3 && p - i >= start; i++) {
+        unsigned char c = p[-i];
+        if (c >= 0xc0)
+            from = p - i;
+        if (c >= 0xc0 || c < 0x80)
+            break;
+    }
+    return validate_utf8_scalar(from, end);
+}
+#endif
+
+static void (*classify)(const unsigned char *, chunk_masks *);
+static const char *(*scan_string_impl)(const char *, const char *);
+static void (*find_lines)(const unsigned char *, position_masks *);
+static const char *(*validate_utf8_impl)(const char *, const char *);
+
+// run before main(), so that the implementations are chosen before any
+// thread can use them
+__attribute__((constructor))
+static void select_impl() {
+    classify = classify_scalar;
+    scan_string_impl = scan_string_scalar;
+    find_lines = find_lines_scalar;
+    validate_utf8_impl = validate_utf8_scalar;
+#ifdef __x86_64__
+    classify = classify_sse2;
+    scan_string_impl = scan_string_sse2;
+    find_lines = find_lines_sse2;
+    validate_utf8_impl = validate_utf8_sse2;
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        classify = classify_avx2;
+        scan_string_impl = scan_string_avx2;
+        find_lines = find_lines_avx2;
+        validate_utf8_impl = validate_utf8_avx2;
+    }
+#endif
+}
+
+// bits of characters preceded by an unescaped backslash; *carry is set if
+// the chunk ends with an unescaped backslash
+static inline uint64_t find_escaped(uint64_t backslash, uint64_t *carry) {
+    uint64_t escaped = *carry;
+    *carry = 0;
+    for (uint64_t b = backslash & ~escaped; b; b &= b - 1) {
+        int i = __builtin_ctzll(b);
+        if (escaped >> i & 1)
+            continue;
+        if (i == 63)
+            *carry = 1;
+        else
+            escaped |= (uint64_t)1 << (i + 1);
+    }
+    return escaped;
+}
+
+// bit i is set to the parity of the number of bits set in [0, i]
+static inline uint64_t prefix_xor(uint64_t x) {
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+}
+
+struct_index mk_index() {
+    struct_index idx = { 0 };
+    idx.pos = malloc(INDEX_BLOCK_SIZE * sizeof(uint32_t));
+    return idx;
+}
+
+static void build_block(struct_index *idx, const char *start,
+                        const char *end) {
+    if (end - start > INDEX_BLOCK_SIZE)
+        end = start + INDEX_BLOCK_SIZE;
+    idx->base = start;
+    idx->end = end;
+    idx->size = 0;
+    idx->next = 0;
+
+    uint64_t in_string = idx->in_string, escape_carry = idx->escape_carry;
+    // whether the byte preceding the chunk was whitespace or an operator
+    uint64_t sep_carry = idx->sep_carry;
+    for (unsigned off = 0; off < end - start; off += 64) {
+        unsigned char tail[64];
+        const unsigned char *s = (const unsigned char *)start + off;
+        if (end - start - off < 64) {
+            memset(tail, ' ', 64);
+            memcpy(tail, s, end - start - off);
+            s = tail;
+        }
+
+        chunk_masks m;
+        classify(s, &m);
+        uint64_t escaped = 0;
+        if (m.backslash | escape_carry)
+            escaped = find_escaped(m.backslash, &escape_carry);
+        uint64_t quote = m.quote & ~escaped;
+        // includes opening quotes, excludes closing ones
+        uint64_t string = prefix_xor(quote) ^ in_string;
+        in_string = (uint64_t)((int64_t)string >> 63);
+
+        uint64_t sep = m.op | m.ws;
+        uint64_t scalar = ~(sep | m.quote) & ~string;
+        uint64_t starts = scalar & (sep << 1 | sep_carry);
+        sep_carry = sep >> 63;
+        uint64_t structural = (m.op & ~string) | (quote & string) | starts;
+
+        // the whitespace padding of the last chunk yields no positions
+        for (; structural; structural &= structural - 1)
+            idx->pos[idx->size++] = off + __builtin_ctzll(structural);
+    }
+    idx->in_string = in_string;
+    idx->escape_carry = escape_carry;
+    idx->sep_carry = sep_carry;
+}
+
+void index_build(struct_index *idx, const char *start, const char *end) {
+    idx->in_string = 0;
+    idx->escape_carry = 0;
+    idx->sep_carry = 1;
+    build_block(idx, start, end);
+}
+
+void index_continue(struct_index *idx, const char *end) {
+    build_block(idx, idx->end, end);
+}
+
+const char *index_next(struct_index *idx, const char *p) {
+    unsigned off = p - idx->base;
+    while (idx->next < idx->size && idx->pos[idx->next] < off)
+        idx->next++;
+    if (idx->next < idx->size)
+        return idx->base + idx->pos[idx->next];
+    return idx->end;
+}
+
+const char *scan_string(const char *p, const char *end) {
+    return scan_string_impl(p, end);
+}
+
+const char *validate_utf8(const char *p, const char *end) {
+    return validate_utf8_impl(p, end);
+}
+
+void count_position(const char *p, const char *end, int *line, int *col) {
+    for (; p < end; p += 64) {
+        unsigned char tail[64];
+        const unsigned char *s = (const unsigned char *)p;
+        if (end - p < 64) {
+            // continuation bytes, which count as nothing
+            memset(tail, 0x80, 64);
+            memcpy(tail, s, end - p);
+            s = tail;
+        }
+        position_masks m;
+        find_lines(s, &m);
+        if (m.newline) {
+            int last = 63 - __builtin_clzll(m.newline);
+            *line += __builtin_popcountll(m.newline);
+            *col = 1 + (last == 63 ? 0
+                                   : __builtin_popcountll(m.lead >> (last + 1)));
+        }
+        else
+            *col += __builtin_popcountll(m.lead);
+    }
+}
+
+void index_free(struct_index *idx) {
+    free(idx->pos);
+    idx->pos = NULL;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdint.h>
+
+// maximum number of input bytes covered by one index block
+#define INDEX_BLOCK_SIZE (1 << 15)
+
+// positions of the structural characters ({}[]:,), opening quotes and
+// starts of other scalars (numbers, literals) within [base, end)
+typedef struct {
+    const char *base, *end;
+    uint32_t *pos;
+    unsigned size, next;
+    // lexical state at end, carried over into the following block
+    uint64_t in_string, escape_carry, sep_carry;
+} struct_index;
+
+struct_index mk_index();
+
+// indexes up to INDEX_BLOCK_SIZE bytes from start, which must not be
+// inside a string
+void index_build(struct_index *idx, const char *start, const char *end);
+
+// indexes the block following the current one, up to at most end
+void index_continue(struct_index *idx, const char *end);
+
+// returns the first indexed position at or after p, or idx->end if there is
+// none within the block; p must not precede any previously returned position
+const char *index_next(struct_index *idx, const char *p);
+
+// returns the first quote, backslash or control character in [p, end), or
+// end if there is none
+const char *scan_string(const char *p, const char *end);
+
+// returns the first byte of [p, end) that does not belong to a valid UTF-8
+// sequence, or end if there is none
+const char *validate_utf8(const char *p, const char *end);
+
+// moves the position *line, *col (in characters) past [p, end)
+void count_position(const char *p, const char *end, int *line, int *col);
+
+void index_free(struct_index *idx);
@@ -0,0 +1,69 @@
+#include <stdint.h>
+#include <string.h>
+#include "intern.h"
+
+#define MIN_CAPACITY 64
+
+struct intern_entry {
+    char *string;
+    uint32_t hash, len;
+};
+
+// FNV-1a
+static inline uint32_t hash_bytes(const char *s, unsigned len) {
+    uint32_t h = 2166136261u;
+    for (unsigned i = 0; i < len; i++)
+        h = (h ^ (unsigned char)s[i]) * 16777619u;
+    return h;
+}
+
+static intern_entry *alloc_slots(arena *a, unsigned capacity) {
+    intern_entry *slots = arena_alloc(a, capacity * sizeof(intern_entry));
+    memset(slots, 0, capacity * sizeof(intern_entry));
+    return slots;
+}
+
+intern_table *mk_intern_table(arena *a) {
+    intern_table *t = arena_alloc(a, sizeof(intern_table));
+    t->arena = a;
+    t->size = 0;
+    t->capacity = MIN_CAPACITY;
+    t->slots = alloc_slots(a, MIN_CAPACITY);
+    return t;
+}
+
+// the old slots stay in the arena, which at most doubles their footprint
+static void grow(intern_table *t) {
+    unsigned capacity = 2 * t->capacity;
+    intern_entry *slots = alloc_slots(t->arena, capacity);
+    for (unsigned i = 0; i < t->capacity; i++) {
+        intern_entry e = t->slots[i];
+        if (!e.string)
+            continue;
+        unsigned j = e.hash & (capacity - 1);
+        while (slots[j].string)
+            j = (j + 1) & (capacity - 1);
+        slots[j] = e;
+    }
+    t->slots = slots;
+    t->capacity = capacity;
+}
+
+char *intern(intern_table *t, const char *s, unsigned len) {
+    uint32_t hash = hash_bytes(s, len);
+    unsigned i = hash & (t->capacity - 1);
+    for (; t->slots[i].string; i = (i + 1) & (t->capacity - 1)) {
+        intern_entry e = t->slots[i];
+        if (e.hash == hash && e.len == len && memcmp(e.string, s, len) == 0)
+            return e.string;
+    }
+
+    char *copy = arena_alloc(t->arena, len + 1);
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+    t->slots[i] = (intern_entry){ copy, hash, len };
+    // kept at most half full
+    if (++t->size * 2 > t->capacity)
+        grow(t);
+    return copy;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "arena.h"
+
+typedef struct intern_entry intern_entry;
+typedef struct intern_table intern_table;
+
+// the distinct strings of a document, so that equal strings are stored once
+// and can be compared by address; everything is allocated from the arena of
+// the document
+struct intern_table {
+    arena *arena;
+    intern_entry *slots;
+    unsigned size, capacity;
+};
+
+intern_table *mk_intern_table(arena *a);
+
+// returns the copy of the len bytes at s held by the table, which is added
+// if there is none yet
+char *intern(intern_table *t, const char *s, unsigned len);
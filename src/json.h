@@ -1,100 +1,236 @@
 #pragma once
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <assert.h>
 #include "buffer.h"
+#include "arena.h"
+#include "intern.h"
 
 typedef struct json_value json_value;
 typedef struct json_member json_member;
+typedef struct json_lazy json_lazy;
+// the children of a container that is being built; see mk_object_value()
+// and mk_array_value()
 typedef buffer json_object;
 typedef buffer json_array;
 
+// strings of up to this many bytes are stored in the value itself
+#define SHORT_STRING_SIZE 8
+
+// how a value was left unparsed
+enum {
+    // a container that was skipped over
+    LAZY_CONTAINER = 1,
+    // a line of a newline-delimited document, see parse_ndjson()
+    LAZY_RECORD
+};
+
+enum {
+    NUL,
+    OBJECT,
+    ARRAY,
+    STRING,
+    NUMBER,
+    INTEGER,
+    TRUE,
+    FALSE
+};
+
+// 16 bytes: containers refer to their children, which are stored
+// contiguously, and know how many there are
 struct json_value {
-    enum { 
-        NUL,
-        OBJECT, 
-        ARRAY, 
-        STRING, 
-        NUMBER, 
-        TRUE, 
-        FALSE
-    } kind;
+    uint8_t kind;
+
+    // set for containers that have not been parsed yet; see value_force()
+    uint8_t lazy;
+
+    // set for strings whose text still contains escapes; see unescape()
+    uint8_t escaped;
 
     union {
-        json_object object;
-        json_array array;
-        char *string;
-        float number;
+        // set for short strings, whose text is kept in chars rather than
+        // referred to; see string_data()
+        uint8_t embedded;
+        // set for containers mapped from a snapshot, whose children refer to
+        // what they contain by offsets from themselves; see resolve_child()
+        uint8_t relative;
     };
+
+    // the number of children of a container, or the length of a string;
+    // for records, only whether there are any children
+    uint32_t size;
+
+    union {
+        json_member *members;
+        json_value *elements;
+        // the text between the quotes, as it appears in the input (which it
+        // usually points into), without a terminating NUL
+        const char *string;
+        char chars[SHORT_STRING_SIZE];
+        double number;
+        int64_t integer;
+        json_lazy *stub;
+        // the start of the line
+        const char *record;
+    };
+};
+
+// the unparsed text of a lazily parsed container
+struct json_lazy {
+    const char *start, *end;
+    // the start of the input, from which errors are located
+    const char *input;
+    // the document the container belongs to, and will be parsed into
+    arena *arena;
+    intern_table *keys;
+    // the parsed container, once it has been materialized
+    int forced;
+    json_value value;
 };
 
 struct json_member {
+    // interned: equal keys within a document share the same address, except
+    // across the runs of parse_json_parallel()
     char *key;
     json_value val; 
 };
 
 static inline json_value mk_object_value(json_object object) {
-    return (json_value) { OBJECT, { .object = object } };
+    return (json_value) { .kind = OBJECT,
+                          .size = object.raw_size / sizeof(json_member),
+                          .members = (json_member *)object.data };
 }
 
 static inline json_value mk_array_value(json_array array) {
-    return (json_value) { ARRAY, { .array = array } };
+    return (json_value) { .kind = ARRAY,
+                          .size = array.raw_size / sizeof(json_value),
+                          .elements = (json_value *)array.data };
 }
 
-static inline json_value mk_string_value(char *string) {
-    return (json_value) { STRING, { .string = string } };
+// copies up to 8 bytes with a few fixed-size moves rather than a call to
+// memcpy(), reading none past the end of src
+static inline void copy_short(char *dest, const char *src, unsigned len) {
+    if (len >= 4) {
+        uint32_t head, tail;
+        memcpy(&head, src, 4);
+        memcpy(&tail, src + len - 4, 4);
+        memcpy(dest, &head, 4);
+        memcpy(dest + len - 4, &tail, 4);
+    }
+    else if (len > 0) {
+        dest[0] = src[0];
+        dest[len / 2] = src[len / 2];
+        dest[len - 1] = src[len - 1];
+    }
 }
 
-static inline json_value mk_number_value(float number) {
-    return (json_value) { NUMBER, { .number = number } };
+// short strings are copied into the value, which saves looking them up
+// elsewhere when they are read
+static inline json_value mk_string_value(const char *string, unsigned len,
+                                         int escaped) {
+    json_value res = { .kind = STRING, .escaped = escaped, .size = len };
+    if (len <= SHORT_STRING_SIZE) {
+        res.embedded = 1;
+        copy_short(res.chars, string, len);
+    }
+    else
+        res.string = string;
+    return res;
+}
+
+// the text of a string; for short strings, it is part of *value, and only
+// valid for as long as that is
+static inline const char *string_data(const json_value *value) {
+    return value->embedded ? value->chars : value->string;
+}
+
+static inline json_value mk_number_value(double number) {
+    return (json_value) { .kind = NUMBER, .number = number };
+}
+
+static inline json_value mk_integer_value(int64_t integer) {
+    return (json_value) { .kind = INTEGER, .integer = integer };
 }
 
 static inline json_value mk_true_value() {
-    return (json_value) { TRUE };
+    return (json_value) { .kind = TRUE };
 }
 
 static inline json_value mk_false_value() {
-    return (json_value) { FALSE };
+    return (json_value) { .kind = FALSE };
 }
 
 static inline json_value mk_null_value() {
-    return (json_value) { NUL };
+    return (json_value) { .kind = NUL };
 }
 
-void value_free(json_value value);
+static inline json_value mk_lazy_value(int kind, unsigned size,
+                                       json_lazy *stub) {
+    return (json_value) { .kind = kind, .lazy = LAZY_CONTAINER, .size = size,
+                          .stub = stub };
+}
+
+static inline json_value mk_record_value(int kind, const char *line) {
+    return (json_value) { .kind = kind, .lazy = LAZY_RECORD, .size = 1,
+                          .record = line };
+}
 
 static inline json_object mk_object() {
     return mk_buffer(64);
 }
 
-static inline unsigned object_size(json_object object) {
-    return object.raw_size / sizeof(json_member);
+static inline unsigned object_size(json_value object) {
+    return object.size;
+}
+
+// the child of a relative container at slot, with its offsets turned into
+// addresses; the snapshot can thus be mapped anywhere, and only the children
+// that are looked at are read
+static inline json_value resolve_child(json_value child, const void *slot) {
+    if ((child.kind == OBJECT || child.kind == ARRAY) && child.size > 0)
+        child.elements = (json_value *)((const char *)slot +
+                                        (intptr_t)child.elements);
+    else if (child.kind == STRING && !child.embedded)
+        child.string = (const char *)slot + (intptr_t)child.string;
+    return child;
 }
 
-static inline json_member object_get(json_object object, int index) {
-    return ((json_member *)object.data)[index];
+static inline json_member object_get(json_value object, int index) {
+    json_member res = object.members[index];
+    if (object.relative) {
+        json_member *slot = &object.members[index];
+        res.key = (char *)&slot->key + (intptr_t)res.key;
+        res.val = resolve_child(res.val, &slot->val);
+    }
+    return res;
 }
 
 static inline void object_append(json_object *object, json_member keyval) {
     buffer_append(object, (const char *)&keyval, sizeof(json_member));
 }
 
-void object_free(json_object object);
-
 static inline json_array mk_array() {
     return mk_buffer(64);
 };
 
-static inline unsigned array_size(json_array array) {
-    return array.raw_size / sizeof(json_value);
+static inline unsigned array_size(json_value array) {
+    return array.size;
 }
 
-static inline json_value array_get(json_object array, int index) {
-    return ((json_value *)array.data)[index];
+static inline json_value array_get(json_value array, int index) {
+    if (array.relative)
+        return resolve_child(array.elements[index], &array.elements[index]);
+    return array.elements[index];
 }
 
 static inline void array_append(json_array *array, json_value val) {
     buffer_append(array, (const char *)&val, sizeof(json_value));
 }
 
-void array_free(json_array array);
+// number of children of a container, known even before it is materialized
+// (except for records, which are only known to be non-empty)
+static inline unsigned container_size(json_value value) {
+    return value.size;
+}
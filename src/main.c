@@ -3,16 +3,30 @@
 #include <unistd.h>
 #include <signal.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <termios.h>
 #include <assert.h>
 #include <locale.h>
 #include <wchar.h>
 #include <limits.h>
+#include <getopt.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <inttypes.h>
 #include "term.h"
 #include "theme.h"
 #include "json.h"
 #include "parse.h"
+#include "ndjson.h"
+#include "binary.h"
 #include "stack.h"
+#include "snapshot.h"
+#include "decompress.h"
 #include "trace.h"
 #include "util.h"
 
@@ -20,7 +34,109 @@
 FILE *trace;
 #endif
 const char *input_filename;
-FILE *input;
+// the keyboard, which is not stdin when the input is read from stdin
+int tty = STDIN_FILENO;
+// inputs that are not mapped are read in blocks from input_fd, which is
+// also kept open while a mapped input is being parsed
+reader *input;
+int input_fd = -1;
+// the mapped input file, kept for as long as the document refers to it; a
+// watched file is copied into memory of its own instead, see read_copy()
+void *input_map;
+size_t input_map_size;
+struct stat input_stat;
+// set while a compressed input is being read
+decompressor *decompressing;
+int input_format;
+int input_corrupt;
+// the encoding of the input, and whether it has only been guessed from its
+// first bytes rather than told by its name
+int input_encoding;
+int encoding_guessed;
+
+// smaller inputs are parsed about as fast as their snapshot is looked up
+#define SNAPSHOT_MIN_SIZE (1 << 22)
+int use_snapshot = 1;
+// where the snapshot of the input is cached, if anywhere
+snapshot_key snapshot_input;
+char *snapshot_path;
+// the document, if it could be read from the snapshot
+snapshot cached;
+
+// holds everything that the parsed document refers to
+arena *document;
+
+int lazy;
+int jobs = 1;
+// whether the input is newline-delimited JSON, and its text, which the
+// records that have not been parsed yet refer to
+int ndjson;
+const char *ndjson_data;
+size_t ndjson_size;
+// the text of an input that is not mapped, but still needed once parsed:
+// that of NDJSON or binary input, or that of lazily or parallel parsed
+// input files
+buffer input_text;
+
+// with --follow, the lines appended to an NDJSON file are added to the
+// document as they are written; the file is mapped with room to grow, so
+// that the records keep their addresses, and watched through inotify
+#define FOLLOW_MAP_SIZE ((size_t)1 << 40)
+int follow;
+int follow_fd = -1, inotify_fd = -1;
+
+// everything that a parsed document refers to, which is released at once
+// when a reload replaces it; documents that are reloaded own all of it,
+// since the file may be rewritten in place, see open_input()
+typedef struct {
+    arena *arena;
+    // the copy of the file, or its mapping on startup, see read_copy()
+    void *map;
+    size_t map_size;
+    const char *ndjson_data;
+    size_t ndjson_size;
+    buffer input_text;
+    snapshot cached;
+    // set if the loader may still be writing the snapshot of the document
+    int loader_running;
+    // the encoding that the document was decoded in, see decode_input()
+    int encoding, encoding_guessed;
+} document_memory;
+
+// with --reload, the file is watched for being rewritten or replaced, and
+// then parsed again on a separate thread while the old document stays in
+// use
+int watch;
+// with --check, the input is only validated, and the exit status tells how
+// that went
+int check;
+enum { CHECK_VALID, CHECK_INVALID, CHECK_UNREADABLE };
+char *watch_name;
+pthread_t reloader;
+int reloading, reload_pending;
+// set by the reloader once done, along with its outcome
+int reload_done;
+parse_result reload_result;
+document_memory reloaded;
+int reload_corrupt;
+// the last lazily parsed container or record that turned out malformed; it
+// is shown empty, with the error in the status bar
+int lazy_failed;
+parse_result lazy_error;
+
+// unless parsing lazily or in parallel, the document is parsed on a
+// background thread while the interface is already up
+parse_progress progress = { .lock = PTHREAD_MUTEX_INITIALIZER };
+pthread_t loader;
+// loading is cleared as soon as the document has been parsed, but the
+// loader keeps running while it writes the snapshot
+int loading, loader_running;
+// the outcome of the background parse, once it has finished
+parse_result load_result;
+struct timespec load_start;
+// written to wake up the main loop (from the loader or signal handlers)
+int wake_pipe[2] = { -1, -1 };
+volatile sig_atomic_t resized;
 
 int term_initialized;
 struct termios saved_term;
@@ -50,8 +166,6 @@ json_stack stack;
 int searching;
 char search_str[256];
 
-#define INT_ROUND_THRES 1e-6
-
 void term_setup() {
     // necessary for proper wcwidth() support
     setlocale(LC_ALL, "");
@@ -60,11 +174,11 @@ void term_setup() {
     printf(CURS_HIDE);
     printf(TRACKING_EN);
     struct termios term;
-    tcgetattr(STDIN_FILENO, &term);
+    tcgetattr(tty, &term);
     saved_term = term;
     term.c_lflag &= ~ECHO;
     term.c_lflag &= ~ICANON;
-    tcsetattr(STDIN_FILENO, TCSAFLUSH, &term);
+    tcsetattr(tty, TCSAFLUSH, &term);
     term_initialized = 1;
 }
 
@@ -87,7 +201,7 @@ int print_row(buffer *dest, const char* key, int index, json_value value,
 
 void pane_resize() {
     struct winsize wsize;
-    ioctl(STDIN_FILENO, TIOCGWINSZ, &wsize);
+    ioctl(tty, TIOCGWINSZ, &wsize);
     window.nrows = wsize.ws_row;
     window.ncols = wsize.ws_col;
 
@@ -122,10 +236,10 @@ void pane_resize() {
             json_pos *pos = stack_peekn(&stack, num_view_panes - 1 - i);
             json_value val = pos->value;
             if (val.kind == OBJECT) {
-                int rows = min(p->nrows, object_size(val.array));
+                int rows = min(p->nrows, object_size(val));
                 int longest_row = 0;
                 for (int di = 0; di < rows; di++) {
-                    json_member memb = object_get(val.object, di);
+                    json_member memb = object_get(val, di);
                     int cols = print_row(
                         &p->rows[di], memb.key, di, memb.val, p->ncols, 0, 0);
                     longest_row = max(longest_row, cols);
@@ -133,10 +247,10 @@ void pane_resize() {
                 p->ncols = min(longest_row + 1, p->ncols);
             }
             else if (val.kind == ARRAY) {
-                int rows = min(p->nrows, array_size(val.array));
+                int rows = min(p->nrows, array_size(val));
                 int longest_row = 0;
                 for (int di = 0; di < rows; di++) {
-                    json_value elt = array_get(val.object, di);
+                    json_value elt = array_get(val, di);
                     int cols = print_row(
                         &p->rows[di], "", di, elt, p->ncols, 0, 0);
                     longest_row = max(longest_row, cols);
@@ -173,14 +287,14 @@ typedef struct {
 int wcwidth(wchar_t);
 
 // returns the number of columns expected to be occupied
-print_cols_r print_cols(buffer *dest, const char *src, int num_cols,
+print_cols_r print_cols(buffer *dest, const char *src, int len, int num_cols,
                         int escape) {
     assert (dest->raw_size >= 1 && dest->data[dest->raw_size - 1] == '\0');
     dest->raw_size--;
 
     int cols = 0;
     int i = 0;
-    for (; src[i] != '\0' && cols < num_cols; ) {
+    for (; i < len && cols < num_cols; ) {
         unsigned char c = src[i];
         if (escape && c == '\n') {
             buffer_putchar(dest, '\\');
@@ -208,6 +322,10 @@ print_cols_r print_cols(buffer *dest, const char *src, int num_cols,
             buffer_putchar(dest, src[i++]);
             cols++;
         }
+        else if (i + (c < 0xe0 ? 2 : c < 0xf0 ? 3 : 4) > len) {
+            // cut off at the end of a decoded prefix, see string_text()
+            break;
+        }
         else { // UTF-8
             wchar_t wc = utf8_decode(
                 (const unsigned char *)&src[i]);
@@ -233,6 +351,22 @@ print_cols_r print_cols(buffer *dest, const char *src, int num_cols,
     return (print_cols_r){cols, i};
 }
 
+// the text of a string, with its escapes decoded as far as needed for about
+// cols columns; *decoded is set to what needs to be freed, and the result
+// may point into *value
+const char *string_text(const json_value *value, int cols, int *len,
+                        char **decoded) {
+    *decoded = NULL;
+    // an escape takes at most 6 bytes, and a column at least one of them
+    size_t max_len = 12 * (size_t)cols;
+    *len = value->size < max_len ? value->size : max_len;
+    if (!value->escaped)
+        return string_data(value);
+    *decoded = malloc(*len + 1);
+    *len = unescape(string_data(value), *len, *decoded);
+    return *decoded;
+}
+
 void print_cur_pos(buffer *dest, int cols) {
     string_nprintf(dest, 0, FMT_BOLD);
     for (int i = 0; i < stack.size - 1 && cols > 0; i++) {
@@ -240,9 +374,9 @@ void print_cur_pos(buffer *dest, int cols) {
         int index = stack.data[i].index;
         switch (value.kind) {
             case OBJECT: {
-                const char* key = object_get(value.object, index).key;
+                const char* key = object_get(value, index).key;
                 cols -= string_nprintf(dest, cols + 1, "%c", '.');
-                cols -= print_cols(dest, key, cols, 1).cols;
+                cols -= print_cols(dest, key, strlen(key), cols, 1).cols;
                 break;
             }
             case ARRAY:
@@ -258,26 +392,34 @@ void print_cur_pos(buffer *dest, int cols) {
 int summarize_value(buffer *dest, json_value value, int cols, int unfolded) {
     switch (value.kind) {
         case OBJECT:
-            if (object_size(value.object) == 0)
+            if (container_size(value) == 0)
                 return string_nprintf(dest, cols + 1, "{}");
             else if (!unfolded)
                 return string_nprintf(dest, cols + 1, "{..}");
             else
                 return 0;
         case ARRAY:
-            if (array_size(value.object) == 0)
+            if (container_size(value) == 0)
                 return string_nprintf(dest, cols + 1, "[]");
             else if (!unfolded)
                 return string_nprintf(dest, cols + 1, "[..]");
             else
                 return 0;
-        case STRING:
-            return print_cols(dest, value.string, cols, 1).cols;
-        case NUMBER:
-            if ((value.number - (int)value.number) < INT_ROUND_THRES)
-                return string_nprintf(dest, cols + 1, "%d", (int)value.number);
-            else
-                return string_nprintf(dest, cols + 1, "%f", value.number);
+        case STRING: {
+            char *decoded;
+            int len;
+            const char *s = string_text(&value, cols, &len, &decoded);
+            int res = print_cols(dest, s, len, cols, 1).cols;
+            free(decoded);
+            return res;
+        }
+        case NUMBER: {
+            char s[32];
+            format_number(s, sizeof(s), value.number);
+            return string_nprintf(dest, cols + 1, "%s", s);
+        }
+        case INTEGER:
+            return string_nprintf(dest, cols + 1, "%" PRId64, value.integer);
         case TRUE:
             return string_nprintf(dest, cols + 1, "true");
         case FALSE:
@@ -307,7 +449,7 @@ int print_row(buffer *dest, const char* key, int index, json_value value,
     if (strlen(key) == 0)
         cols -= string_nprintf(dest, cols + 1, "%d  ", index);
     else {
-        cols -= print_cols(dest, key, cols, 1).cols;
+        cols -= print_cols(dest, key, strlen(key), cols, 1).cols;
         cols -= string_nprintf(dest, cols + 1, "  ");
     }
     assert(dest->data[dest->raw_size - 1] == '\0');
@@ -331,9 +473,10 @@ int print_row(buffer *dest, const char* key, int index, json_value value,
 int print_value(buffer *dest, json_value value, int rows, int cols, int indent) {
     if (rows <= 0 || indent >= cols)
         return 0;
+    value = value_force(value);
     switch (value.kind) {
         case OBJECT:
-            if (object_size(value.object) == 0) {
+            if (object_size(value) == 0) {
                 if (indent > 0)
                     return 0;
                 append_spaces(&dest[0], indent);
@@ -344,8 +487,8 @@ int print_value(buffer *dest, json_value value, int rows, int cols, int indent)
             }
             else {
                 int ri = 0;
-                for (int di = 0; ri < rows && di < object_size(value.object); di++) {
-                    json_member memb = object_get(value.object, di);
+                for (int di = 0; ri < rows && di < object_size(value); di++) {
+                    json_member memb = object_get(value, di);
                     append_spaces(&dest[ri], indent);
                     print_row(&dest[ri++], memb.key, di, memb.val, cols - indent, 0, 1);
                     if (memb.val.kind == OBJECT || memb.val.kind == ARRAY) {
@@ -356,7 +499,7 @@ int print_value(buffer *dest, json_value value, int rows, int cols, int indent)
                 return ri;
             }
         case ARRAY:
-            if (array_size(value.array) == 0) {
+            if (array_size(value) == 0) {
                 if (indent > 0)
                     return 0;
                 append_spaces(&dest[0], indent);
@@ -367,8 +510,8 @@ int print_value(buffer *dest, json_value value, int rows, int cols, int indent)
             }
             else {
                 int ri = 0;
-                for (int di = 0; ri < rows && di < array_size(value.array); di++) {
-                    json_value elt = array_get(value.array, di);
+                for (int di = 0; ri < rows && di < array_size(value); di++) {
+                    json_value elt = array_get(value, di);
                     append_spaces(&dest[ri], indent);
                     print_row(&dest[ri++], "", di, elt, cols - indent, 0, 1);
                     if (elt.kind == OBJECT || elt.kind == ARRAY) {
@@ -388,9 +531,9 @@ int print_value(buffer *dest, json_value value, int rows, int cols, int indent)
 int get_num_items(json_value value) {
     switch (value.kind) {
         case OBJECT:
-            return object_size(value.object);
+            return object_size(value);
         case ARRAY:
-            return array_size(value.array);
+            return array_size(value);
         default:
             return 1;
     }
@@ -415,9 +558,9 @@ void populate_view(pane *p, json_pos pos, int is_top) {
                 print_value(p->rows, value, p->nrows, p->ncols, 0);
             else {
                 for (int ri = 0, di = off;
-                    ri < p->nrows && di < object_size(value.object);
+                    ri < p->nrows && di < object_size(value);
                     ri++, di++) {
-                    json_member memb = object_get(value.object, di);
+                    json_member memb = object_get(value, di);
                     print_row(&p->rows[ri], memb.key, di, memb.val, p->ncols,
                               !is_top && ri == curs_ri, 0);
                 }
@@ -428,9 +571,9 @@ void populate_view(pane *p, json_pos pos, int is_top) {
                 print_value(p->rows, value, p->nrows, p->ncols, 0);
             else {
                 for (int ri = 0, di = off;
-                    ri < p->nrows && di < array_size(value.array);
+                    ri < p->nrows && di < array_size(value);
                     ri++, di++) {
-                    json_value elt = array_get(value.array, di);
+                    json_value elt = array_get(value, di);
                     print_row(&p->rows[ri], "", di, elt, p->ncols,
                               !is_top && ri == curs_ri, 0);
                 }
@@ -438,15 +581,19 @@ void populate_view(pane *p, json_pos pos, int is_top) {
             break;
         case STRING: {
             assert(is_top);
-            char *s = value.string;
-            if (s[0] == '\0') {
+            if (value.size == 0) {
                 string_nprintf(&p->rows[0], p->ncols + 1 + 8,
                     FMT_ITALIC "<Empty string>" FMT_RESET);
                 break;
             }
-            for (int i = 0, ri = 0; ri < p->nrows && s[i] != '\0'; ri++) {
-                s += print_cols(&p->rows[ri], &s[i], p->ncols, 0).num_read;
-            }
+            char *decoded;
+            int len;
+            const char *s = string_text(&value, p->nrows * p->ncols, &len,
+                                        &decoded);
+            for (int i = 0, ri = 0; ri < p->nrows && i < len; ri++)
+                i += print_cols(&p->rows[ri], &s[i], len - i, p->ncols,
+                                0).num_read;
+            free(decoded);
             break;
         }
         default:
@@ -464,6 +611,98 @@ void draw_pane(pane *p) {
     }
 }
 
+static void format_size(char *dest, size_t size) {
+    const char *units[] = { "B", "KB", "MB", "GB", "TB" };
+    double s = size;
+    int u = 0;
+    for (; s >= 1000 && u < 4; u++)
+        s /= 1000;
+    snprintf(dest, 16, u == 0 ? "%.0f %s" : "%.1f %s", s, units[u]);
+}
+
+void print_parse_error(buffer *dest, int cols, const char *what,
+                       parse_result pr) {
+    if (pr.error.kind == BINARY_ERROR)
+        string_nprintf(dest, cols + 1,
+            "  %s at byte %zu: malformed %s", what, pr.error.offset,
+            encoding_name(input_encoding));
+    else if (pr.error.kind == ENCODING_ERROR)
+        string_nprintf(dest, cols + 1,
+            "  %s on line %d, column %d: invalid UTF-8 byte 0x%02x",
+            what, pr.error.line, pr.error.col, (unsigned char)pr.error.tok);
+    else if (pr.error.tok == EOF)
+        string_nprintf(dest, cols + 1,
+            "  %s on line %d: unexpected end of input", what, pr.error.line);
+    else if (pr.error.tok >= 0x80)
+        string_nprintf(dest, cols + 1,
+            "  %s on line %d, column %d: unexpected byte 0x%02x",
+            what, pr.error.line, pr.error.col, pr.error.tok);
+    else
+        string_nprintf(dest, cols + 1,
+            "  %s on line %d, column %d: unexpected character %c",
+            what, pr.error.line, pr.error.col, pr.error.tok);
+}
+
+// the input name, followed by the loading progress or outcome
+void print_status(buffer *dest, int cols) {
+    cols -= string_nprintf(dest, cols + 1, "%s", input_filename);
+    if (cols <= 0)
+        return;
+    if (loading) {
+        size_t consumed = __atomic_load_n(&progress.consumed, __ATOMIC_RELAXED);
+        char done[16], total[16];
+        format_size(done, consumed);
+        // compressed inputs are measured by how much of the file has been
+        // decompressed
+        size_t pos = consumed;
+        size_t size = S_ISREG(input_stat.st_mode) ? input_stat.st_size : 0;
+        if (decompressing) {
+            pos = decompress_consumed(decompressing);
+            size = input_stat.st_size;
+        }
+        if (size == 0 || pos == 0) {
+            string_nprintf(dest, cols + 1, "  loading: %s", done);
+            return;
+        }
+        format_size(total, size);
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double elapsed = (now.tv_sec - load_start.tv_sec) +
+                         (now.tv_nsec - load_start.tv_nsec) / 1e9;
+        int left = elapsed * (size - pos) / pos;
+        if (decompressing)
+            string_nprintf(dest, cols + 1,
+                "  loading: %d%% of %s (%s decompressed), %d:%02d left",
+                (int)(100.0 * pos / size), total, done, left / 60, left % 60);
+        else
+            string_nprintf(dest, cols + 1,
+                "  loading: %d%% (%s of %s), %d:%02d left",
+                (int)(100.0 * pos / size), done, total, left / 60, left % 60);
+    }
+    else if (follow) {
+        cols -= string_nprintf(dest, cols + 1, "  following: %u records",
+                               array_size(stack.data[0].value));
+        if (lazy_failed && cols > 0)
+            print_parse_error(dest, cols, "last error", lazy_error);
+    }
+    else if (lazy_failed)
+        print_parse_error(dest, cols, "malformed value", lazy_error);
+    else if (input_corrupt) {
+        string_nprintf(dest, cols + 1, "  error: corrupt %s input",
+                       compression_name(input_format));
+    }
+    else if (!load_result.success && progress.done)
+        print_parse_error(dest, cols, "error", load_result);
+    else if (reloading)
+        string_nprintf(dest, cols + 1, "  reloading");
+    else if (reload_corrupt) {
+        string_nprintf(dest, cols + 1, "  reload failed: corrupt %s input",
+                       compression_name(input_format));
+    }
+    else if (!reload_result.success && reload_done)
+        print_parse_error(dest, cols, "reload failed", reload_result);
+}
+
 void draw() {
     // clear existing data
     string_clear(&window.top_bar.rows[0]);
@@ -474,13 +713,15 @@ void draw() {
 
     // fill each pane with corresponding data
     if (!searching)
-        string_nprintf(&window.status_bar.rows[0], window.status_bar.ncols + 1,
-            "%s", input_filename);
+        print_status(&window.status_bar.rows[0], window.status_bar.ncols);
     else
         string_nprintf(&window.status_bar.rows[0], window.status_bar.ncols + 1,
             "/%s", search_str);
     print_cur_pos(&window.top_bar.rows[0], window.top_bar.ncols);
     assert(stack.size >= 1);
+    // the record being browsed has to stay parsed
+    if (ndjson && stack.size > 1 && array_size(stack.data[0].value) > 0)
+        ndjson_pin(array_get(stack.data[0].value, stack.data[0].index));
     int num_view_panes = min(stack.size, NUM_VIEW_PANES);
     for (int i = num_view_panes - 1, si = 0; i >= 0; i--, si++) {
         populate_view(&window.view_panes[i], *stack_peekn(&stack, si), si == 0);
@@ -503,14 +744,15 @@ void move_to_child() {
     switch (cur->value.kind) {
         json_value next;
         case OBJECT:
-            if (object_size(cur->value.object) > 0) {
-                next = object_get(cur->value.object, cur->index).val;
+            if (object_size(cur->value) > 0) {
+                next = value_force(object_get(cur->value,
+                                              cur->index).val);
                 stack_push(&stack, (json_pos){ next, 0 });
             }
             break;
         case ARRAY:
-            if (array_size(cur->value.array) > 0) {
-                next = array_get(cur->value.object, cur->index);
+            if (array_size(cur->value) > 0) {
+                next = value_force(array_get(cur->value, cur->index));
                 stack_push(&stack, (json_pos){ next, 0 });
             }
             break;
@@ -526,10 +768,10 @@ void move_to_next(int off) {
         int max_idx = 0;
         switch (cur->value.kind) {
             case OBJECT:
-                max_idx = object_size(cur->value.object) - 1;
+                max_idx = object_size(cur->value) - 1;
                 break;
             case ARRAY:
-                max_idx = array_size(cur->value.array) - 1;
+                max_idx = array_size(cur->value) - 1;
                 break;
             default:
                 break;
@@ -540,10 +782,14 @@ void move_to_next(int off) {
 }
 
 void search_next(int rev) {
-    json_stack search_stack = stack;
+    json_stack search_stack = stack_copy(&stack);
     search(&search_stack, search_str, rev);
-    if (search_stack.size > 0)
+    if (search_stack.size > 0) {
+        stack_free(&stack);
         stack = search_stack;
+    }
+    else
+        stack_free(&search_stack);
 }
 
 void handle_mouse_press(int x, int y) {
@@ -581,9 +827,9 @@ void handle_mouse_press(int x, int y) {
     json_value val = pos->value;
     int tot_rows = 0;
     if (val.kind == OBJECT)
-        tot_rows = object_size(val.object);
+        tot_rows = object_size(val);
     else if (val.kind == ARRAY)
-        tot_rows = array_size(val.array);
+        tot_rows = array_size(val);
     if (ri >= tot_rows)
         return;
 
@@ -611,154 +857,861 @@ void handle_mouse_press(int x, int y) {
     }
 }
 
-void loop() {
-    while (1) {
-        char in[6];
-        int num_read = read(STDIN_FILENO, &in, 6);
-        switch (in[0]) {
-            case '\x1b':
-                if (num_read == 1) { // ESC key
-                    if (!searching)
-                        return;
-                    else {
-                        searching = 0;
-                        search_str[0] = '\0';
+// returns 1 if the input was a request to quit
+int handle_input(char *in, int num_read) {
+    switch (in[0]) {
+        case '\x1b':
+            if (num_read == 1) { // ESC key
+                if (!searching)
+                    return 1;
+                else {
+                    searching = 0;
+                    search_str[0] = '\0';
+                    draw();
+                    break;
+                }
+            }
+            if (num_read >= 3 && in[1] == '[') {
+                switch (in[2]) {
+                    case KEY_UP:
+                        move_to_next(-1);
                         draw();
                         break;
-                    }
-                }
-                if (num_read >= 3 && in[1] == '[') {
-                    switch (in[2]) {
-                        case KEY_UP:
-                            move_to_next(-1);
+                    case KEY_DOWN:
+                        move_to_next(1);
+                        draw();
+                        break;
+                    case KEY_RIGHT:
+                        move_to_child();
+                        pane_resize();
+                        draw();
+                        break;
+                    case KEY_LEFT:
+                        move_to_parent();
+                        pane_resize();
+                        draw();
+                        break;
+                    case '5':
+                        if (in[3] == '~') { // PgUp
+                            move_to_next(-window.view_panes[0].nrows);
                             draw();
-                            break;
-                        case KEY_DOWN:
-                            move_to_next(1);
+                        }
+                        break;
+                    case '6':
+                        if (in[3] == '~') { // PgDown
+                            move_to_next(window.view_panes[0].nrows);
                             draw();
-                            break;
-                        case KEY_RIGHT:
-                            move_to_child();
-                            pane_resize();
+                        }
+                        break;
+                    case '7':
+                    case 'H':
+                        if (in[3] == '~') { // Home
+                            move_to_next(INT_MIN);
                             draw();
-                            break;
-                        case KEY_LEFT:
-                            move_to_parent();
+                        }
+                        break;
+                    case '8':
+                    case 'F':
+                        if (in[3] == '~') { // End
+                            move_to_next(INT_MAX);
+                            draw();
+                        }
+                        break;
+                    case 'M': {
+                        char b = in[3] - 32;
+                        char Cx = in[4] - 32, Cy = in[5] - 32;
+                        if (b == 0) { // Left button
+                            handle_mouse_press(Cx - 1, Cy - 1);
                             pane_resize();
                             draw();
-                            break;
-                        case '5':
-                            if (in[3] == '~') { // PgUp
-                                move_to_next(-window.view_panes[0].nrows);
-                                draw();
-                            }
-                            break;
-                        case '6':
-                            if (in[3] == '~') { // PgDown
-                                move_to_next(window.view_panes[0].nrows);
-                                draw();
-                            }
-                            break;
-                        case '7':
-                        case 'H':
-                            if (in[3] == '~') { // Home
-                                move_to_next(INT_MIN);
-                                draw();
-                            }
-                            break;
-                        case '8':
-                        case 'F':
-                            if (in[3] == '~') { // End
-                                move_to_next(INT_MAX);
-                                draw();
-                            }
-                            break;
-                        case 'M': {
-                            char b = in[3] - 32;
-                            char Cx = in[4] - 32, Cy = in[5] - 32;
-                            if (b == 0) { // Left button
-                                handle_mouse_press(Cx - 1, Cy - 1);
-                                pane_resize();
-                                draw();
-                            }
-                            else if (b == 64) { // Mouse wheel up
-                                move_to_next(-1);
-                                draw();
-                            }
-                            else if (b == 65) { // Mouse wheel down
-                                move_to_next(1);
-                                draw();
-                            }
-                            break;
                         }
+                        else if (b == 64) { // Mouse wheel up
+                            move_to_next(-1);
+                            draw();
+                        }
+                        else if (b == 65) { // Mouse wheel down
+                            move_to_next(1);
+                            draw();
+                        }
+                        break;
                     }
                 }
-                break;
-            case '\x7f': // Backspace key
-                if (!searching) {
-                    move_to_parent();
-                    pane_resize();
-                }
-                else if (search_str[0] != '\0') {
-                    int i;
-                    for (i = 0; search_str[i] != '\0'; i++);
-                    search_str[i-1] = '\0';
-                }
-                draw();
-                break;
-            case '\x0a': // Enter key
-                if (!searching)
-                    move_to_child();
-                else {
-                    searching = 0;
-                    search_next(0);
-                }
+            }
+            break;
+        case '\x7f': // Backspace key
+            if (!searching) {
+                move_to_parent();
+                pane_resize();
+            }
+            else if (search_str[0] != '\0') {
+                int i;
+                for (i = 0; search_str[i] != '\0'; i++);
+                search_str[i-1] = '\0';
+            }
+            draw();
+            break;
+        case '\x0a': // Enter key
+            if (!searching)
+                move_to_child();
+            else {
+                searching = 0;
+                search_next(0);
+            }
+            pane_resize();
+            draw();
+            break;
+        case '/':
+            search_str[0] = '\0';
+            searching = 1;
+            draw();
+            break;
+        case 'n': {
+            if (!searching) {
+                if (search_str[0] == '\0')
+                    break;
+                search_next(0);
                 pane_resize();
                 draw();
                 break;
-            case '/':
-                search_str[0] = '\0';
-                searching = 1;
+            }
+            // fallthrough
+        }
+        case 'b':
+        case 'N': {
+            if (!searching) {
+                if (search_str[0] == '\0')
+                    break;
+                search_next(1);
+                pane_resize();
                 draw();
                 break;
-            case 'n': {
-                if (!searching) {
-                    if (search_str[0] == '\0')
-                        break;
-                    search_next(0);
-                    pane_resize();
-                    draw();
-                    break;
-                }
-                // fallthrough
             }
-            case 'b':
-            case 'N': {
-                if (!searching) {
-                    if (search_str[0] == '\0')
-                        break;
-                    search_next(1);
-                    pane_resize();
-                    draw();
-                    break;
-                }
-                // fallthrough
+            // fallthrough
+        }
+        case 'q':
+            if (!searching)
+                return 1;
+            // fallthrough
+        default: {
+            if (searching) {
+                int i;
+                for (i = 0; search_str[i] != '\0'; i++);
+                search_str[i] = in[0];
+                search_str[i+1] = '\0';
+                draw();
             }
-            case 'q':
-                if (!searching)
-                    return;
-                // fallthrough
-            default: {
-                if (searching) {
-                    int i;
-                    for (i = 0; search_str[i] != '\0'; i++);
-                    search_str[i] = in[0];
-                    search_str[i+1] = '\0';
-                    draw();
-                }
+        }
+    }
+    return 0;
+}
+
+// whether the input file is watched for being rewritten, see watch_input()
+int watching(const char *filename) {
+    return filename && watch && !follow && !check;
+}
+
+// reads the size bytes of the regular file fd into memory of their own,
+// which is then used, and released, like a mapping of the file: it is
+// sized once, and parsed in place; returns MAP_FAILED if the file cannot be
+// read in full, as when it is cut short while being read
+void *read_copy(int fd, size_t size) {
+    char *data = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED)
+        return MAP_FAILED;
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pread(fd, data + done, size - done, done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    if (done < size) {
+        munmap(data, size);
+        return MAP_FAILED;
+    }
+    return data;
+}
+
+// regular files are mapped and parsed in place, unless they are compressed;
+// watched ones are copied, and anything else (pipes, character devices,
+// ...) is read on a separate thread; a NULL filename stands for stdin
+void open_input(const char *filename) {
+    int fd = filename ? open(filename, O_RDONLY) : STDIN_FILENO;
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "Error reading input file\n");
+        exit(check ? CHECK_UNREADABLE : EXIT_FAILURE);
+    }
+    input_stat = st;
+    unsigned char magic[MAGIC_SIZE];
+    ssize_t n = S_ISREG(st.st_mode) ? pread(fd, magic, MAGIC_SIZE, 0) : 0;
+    input_format = detect_compression(magic, n > 0 ? n : 0);
+    if (input_format != UNCOMPRESSED) {
+        decompressing = decompress_start(fd, input_format);
+        if (!decompressing) {
+            fprintf(stderr, "Error decompressing %s input\n",
+                    compression_name(input_format));
+            exit(check ? CHECK_UNREADABLE : EXIT_FAILURE);
+        }
+        input_fd = fileno(decompress_output(decompressing));
+        input = reader_start(input_fd);
+        return;
+    }
+    if (S_ISREG(st.st_mode) && follow) {
+        void *data = mmap(NULL, FOLLOW_MAP_SIZE, PROT_READ,
+                          MAP_SHARED | MAP_NORESERVE, fd, 0);
+        if (data != MAP_FAILED) {
+            follow_fd = fd;
+            input_map = data;
+            input_map_size = st.st_size;
+            return;
+        }
+    }
+    // a watched file may be rewritten in place, which would change the text
+    // of the document under it, or cut it short (and reading past the end
+    // of the file raises SIGBUS), so the document refers to a copy instead
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *data = watching(filename)
+            ? read_copy(fd, st.st_size)
+            : mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            if (!lazy && !ndjson && !check)
+                madvise(data, st.st_size, MADV_SEQUENTIAL);
+            input_fd = fd;
+            input_map = data;
+            input_map_size = st.st_size;
+            return;
+        }
+    }
+    input_fd = fd;
+    input = reader_start(fd);
+    if (!input) {
+        fprintf(stderr, "Error reading input file\n");
+        exit(check ? CHECK_UNREADABLE : EXIT_FAILURE);
+    }
+}
+
+// releases what is left of the input once it has been parsed; a mapped
+// input is kept, since the strings of the document refer to it
+void close_input() {
+    if (input)
+        reader_finish(input);
+    input = NULL;
+    if (decompressing) {
+        input_corrupt = !decompress_finish(decompressing);
+        decompressing = NULL;
+    }
+    else if (input_fd >= 0)
+        close(input_fd);
+    input_fd = -1;
+}
+
+// reads the rest of r into text, for inputs that are only processed in
+// memory
+void read_all(reader *r, buffer *text) {
+    *text = mk_buffer(1 << 20);
+    const char *block;
+    size_t n;
+    while ((n = reader_next(r, &block)) > 0)
+        buffer_append(text, block, n);
+}
+
+parse_result parse_input() {
+    parse_result pr;
+    if (input_map && lazy)
+        pr = parse_json_lazy(input_map, input_map_size);
+    else if (input_map)
+        pr = parse_json_parallel(input_map, input_map_size, jobs);
+    else
+        pr = parse_json_progress(NULL, 0, input, NULL);
+    close_input();
+    return pr;
+}
+
+// decodes a binary input in *encoding; an encoding that has only been
+// guessed is given up for the other one if the input does not decode, and
+// kept for reloads otherwise
+parse_result decode_input(const char *data, size_t len, int *encoding,
+                          int *guessed) {
+    parse_result pr = parse_binary(data, len, *encoding);
+    if (!pr.success && *guessed) {
+        int other = *encoding == CBOR ? MSGPACK : CBOR;
+        parse_result retry = parse_binary(data, len, other);
+        if (retry.success) {
+            *encoding = other;
+            pr = retry;
+        }
+    }
+    if (pr.success)
+        *guessed = 0;
+    return pr;
+}
+
+// binary input is decoded from memory, so an input that is not mapped is
+// read first
+parse_result parse_binary_input() {
+    if (!input_map)
+        read_all(input, &input_text);
+    close_input();
+    if (input_map)
+        return decode_input(input_map, input_map_size, &input_encoding,
+                            &encoding_guessed);
+    return decode_input(input_text.data, input_text.raw_size,
+                        &input_encoding, &encoding_guessed);
+}
+
+// the length of the complete lines at the start of data
+size_t complete_lines(const char *data, size_t len) {
+    while (len > 0 && data[len - 1] != '\n')
+        len--;
+    return len;
+}
+
+// NDJSON is only indexed, so an input that cannot be mapped is read into
+// memory first
+parse_result parse_ndjson_input() {
+    if (input_map) {
+        ndjson_data = input_map;
+        ndjson_size = input_map_size;
+        // a line that is still being written is added once it is complete
+        if (follow)
+            ndjson_size = complete_lines(ndjson_data, ndjson_size);
+    }
+    else {
+        read_all(input, &input_text);
+        ndjson_data = input_text.data;
+        ndjson_size = input_text.raw_size;
+    }
+    close_input();
+    return parse_ndjson(ndjson_data, ndjson_size);
+}
+
+// whether filename ends in ext, compressed or not
+int has_extension(const char *filename, const char *ext) {
+    static const char *compressed[] = { ".gz", ".xz", ".zst" };
+    size_t len = strlen(filename), ext_len = strlen(ext);
+    for (int i = 0; i < 3; i++) {
+        size_t n = strlen(compressed[i]);
+        if (len > n && strcmp(filename + len - n, compressed[i]) == 0) {
+            len -= n;
+            break;
+        }
+    }
+    return len > ext_len &&
+           strncmp(filename + len - ext_len, ext, ext_len) == 0;
+}
+
+// *.ndjson and *.jsonl files
+int is_ndjson_filename(const char *filename) {
+    return has_extension(filename, ".ndjson") ||
+           has_extension(filename, ".jsonl");
+}
+
+// binary inputs are told by their extension, or else by their first bytes
+void detect_input_encoding(const char *filename) {
+    if (filename && has_extension(filename, ".cbor"))
+        input_encoding = CBOR;
+    else if (filename && (has_extension(filename, ".msgpack") ||
+                          has_extension(filename, ".mpk")))
+        input_encoding = MSGPACK;
+    else if (!ndjson) {
+        const char *head = input_map;
+        size_t len = input_map ? input_map_size : reader_peek(input, &head);
+        input_encoding = detect_encoding((const unsigned char *)head, len);
+        encoding_guessed = 1;
+    }
+}
+
+// checks NDJSON as it is read, keeping no more than a block and the line
+// that runs past it in memory
+parse_result check_ndjson_stream(size_t *size) {
+    buffer pending = mk_buffer(1 << 20);
+    parse_result pr = { .success = 1 };
+    int line = 1;
+    const char *block;
+    size_t n;
+    *size = 0;
+    while (pr.success && (n = reader_next(input, &block)) > 0) {
+        *size += n;
+        buffer_append(&pending, block, n);
+        size_t len = complete_lines(pending.data, pending.raw_size);
+        pr = check_json_lines(pending.data, len, line);
+        for (const char *p = pending.data;
+             (p = memchr(p, '\n', pending.data + len - p)); p++)
+            line++;
+        memmove(pending.data, pending.data + len, pending.raw_size - len);
+        pending.raw_size -= len;
+    }
+    if (pr.success)
+        pr = check_json_lines(pending.data, pending.raw_size, line);
+    buffer_free(&pending);
+    return pr;
+}
+
+// validates the input as it is read, without building a document, and
+// reports the outcome along with the throughput; returns the exit status
+int check_input(const char *filename) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    open_input(filename);
+    detect_input_encoding(filename);
+    // a mapped file is walked a block at a time, as if it was read, so that
+    // it does not stay resident
+    if (input_map)
+        input = reader_map(input_map, input_map_size);
+    size_t size;
+    parse_result pr;
+    if (input_encoding != JSON_TEXT) {
+        // a guessed encoding is settled on the first block, which is as
+        // much as a stream can be read again
+        if (encoding_guessed) {
+            const char *head;
+            size_t len = reader_peek(input, &head);
+            int other = input_encoding == CBOR ? MSGPACK : CBOR;
+            pr = check_binary(head, len, NULL, input_encoding, NULL);
+            // unless it only ran out of the block
+            if (!pr.success && pr.error.tok != EOF) {
+                parse_result retry = check_binary(head, len, NULL, other,
+                                                  NULL);
+                if (retry.success || retry.error.tok == EOF)
+                    input_encoding = other;
             }
+        }
+        pr = check_binary(NULL, 0, input, input_encoding, &size);
+    }
+    else
+        pr = ndjson ? check_ndjson_stream(&size)
+                    : check_json(NULL, 0, input, &size);
+    close_input();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (input_corrupt) {
+        fprintf(stderr, "Error: corrupt %s input\n",
+                compression_name(input_format));
+        return CHECK_UNREADABLE;
+    }
 
+    double seconds = (end.tv_sec - start.tv_sec) +
+                     (end.tv_nsec - start.tv_nsec) / 1e9;
+    char total[16], rate[16];
+    format_size(total, size);
+    format_size(rate, seconds > 0 ? size / seconds : size);
+    if (!pr.success) {
+        print_error(stderr, pr);
+        fprintf(stderr, "%s: invalid %s after %s (%.2f s, %s/s)\n",
+                input_filename, encoding_name(input_encoding), total,
+                seconds, rate);
+        return CHECK_INVALID;
+    }
+    printf("%s: valid %s, %s in %.2f s (%s/s)\n", input_filename,
+           encoding_name(input_encoding), total, seconds, rate);
+    return CHECK_VALID;
+}
+
+// a followed file that has been truncated (as by logrotate's copytruncate)
+// is indexed again from its start, since the records past its new end can
+// no longer be read
+void restart_following() {
+    ndjson_release(ndjson_data, ndjson_size);
+    arena_free(document);
+    parse_result pr = parse_ndjson(ndjson_data, 0);
+    document = pr.arena;
+    ndjson_size = 0;
+    lazy_failed = 0;
+    stack.size = 0;
+    stack_push(&stack, (json_pos){ pr.res, 0 });
+}
+
+// adds the lines appended to a followed file; the cursor stays on its
+// record, unless that is the last one, in which case it moves on to the new
+// last record
+void follow_input() {
+    char events[4096];
+    while (read(inotify_fd, events, sizeof(events)) > 0)
+        ;
+    struct stat st;
+    if (fstat(follow_fd, &st) < 0 || (size_t)st.st_size > FOLLOW_MAP_SIZE)
+        return;
+    if ((size_t)st.st_size < ndjson_size)
+        restart_following();
+    if ((size_t)st.st_size <= ndjson_size)
+        return;
+    size_t len = ndjson_size + complete_lines(ndjson_data + ndjson_size,
+                                              st.st_size - ndjson_size);
+    if (len == ndjson_size)
+        return;
+
+    json_value *root = &stack.data[0].value;
+    unsigned old_size = array_size(*root);
+    int at_tail = stack.size == 1 ||
+                  (stack.size == 2 && stack.data[0].index == old_size - 1);
+    parse_result pr = ndjson_append(ndjson_data, len, root);
+    // malformed lines are skipped, and reported like a malformed record
+    if (!pr.success)
+        on_lazy_error(pr);
+    ndjson_size = len;
+    if (at_tail && array_size(*root) > old_size) {
+        if (stack.size == 2)
+            stack_pop(&stack);
+        stack.data[0].index = array_size(*root) - 1;
+        move_to_child();
+    }
+}
+
+// parses the input file again, the way it was parsed on startup, into doc;
+// the file is copied rather than mapped, see open_input()
+parse_result parse_file(document_memory *doc, int *corrupt) {
+    parse_result pr = { .error = { 1, 1, EOF } };
+    int fd = open(input_filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0)
+            close(fd);
+        return pr;
+    }
+    unsigned char magic[MAGIC_SIZE];
+    ssize_t n = pread(fd, magic, MAGIC_SIZE, 0);
+    int format = detect_compression(magic, n > 0 ? n : 0);
+    if (format == UNCOMPRESSED && st.st_size > 0) {
+        void *data = read_copy(fd, st.st_size);
+        close(fd);
+        if (data == MAP_FAILED)
+            return pr;
+        doc->map = data;
+        doc->map_size = st.st_size;
+        if (ndjson) {
+            doc->ndjson_data = data;
+            doc->ndjson_size = st.st_size;
+            return parse_ndjson(data, st.st_size);
         }
+        if (doc->encoding != JSON_TEXT)
+            return decode_input(data, st.st_size, &doc->encoding,
+                                &doc->encoding_guessed);
+        if (lazy)
+            return parse_json_lazy(data, st.st_size);
+        return parse_json_parallel(data, st.st_size, jobs);
+    }
+
+    decompressor *d = NULL;
+    int in = fd;
+    if (format != UNCOMPRESSED) {
+        d = decompress_start(fd, format);
+        in = d ? fileno(decompress_output(d)) : -1;
+    }
+    reader *r = in >= 0 ? reader_start(in) : NULL;
+    if (r && ndjson) {
+        read_all(r, &doc->input_text);
+        doc->ndjson_data = doc->input_text.data;
+        doc->ndjson_size = doc->input_text.raw_size;
+        pr = parse_ndjson(doc->ndjson_data, doc->ndjson_size);
+    }
+    else if (r && doc->encoding != JSON_TEXT) {
+        read_all(r, &doc->input_text);
+        pr = decode_input(doc->input_text.data, doc->input_text.raw_size,
+                          &doc->encoding, &doc->encoding_guessed);
+    }
+    else if (r)
+        pr = parse_json_progress(NULL, 0, r, NULL);
+    if (r)
+        reader_finish(r);
+    if (d)
+        *corrupt = !decompress_finish(d);
+    else if (format == UNCOMPRESSED)
+        close(fd);
+    return pr;
+}
+
+// runs on the reloader thread
+void *reload(void *arg) {
+    document_memory doc = reloaded;
+    int corrupt = 0;
+    parse_result pr = parse_file(&doc, &corrupt);
+    doc.arena = pr.arena;
+    // the records of a failed NDJSON parse have not been registered
+    if (!pr.success)
+        doc.ndjson_data = NULL;
+    reload_result = pr;
+    reloaded = doc;
+    reload_corrupt = corrupt;
+    __atomic_store_n(&reload_done, 1, __ATOMIC_RELEASE);
+    write(wake_pipe[1], "", 1);
+    return NULL;
+}
+
+// releases a document that has been replaced; runs on a thread of its own,
+// so that a large document does not hold up the interface
+void *retire(void *arg) {
+    document_memory *doc = arg;
+    if (doc->loader_running) {
+        __atomic_store_n(&progress.cancel, 1, __ATOMIC_RELAXED);
+        pthread_join(loader, NULL);
+    }
+    if (doc->ndjson_data)
+        ndjson_release(doc->ndjson_data, doc->ndjson_size);
+    arena_free(doc->arena);
+    if (doc->map)
+        munmap(doc->map, doc->map_size);
+    buffer_free(&doc->input_text);
+    snapshot_close(&doc->cached);
+    free(doc);
+    return NULL;
+}
+
+void retire_later(document_memory doc) {
+    document_memory *arg = malloc(sizeof(document_memory));
+    *arg = doc;
+    pthread_t retirer;
+    if (pthread_create(&retirer, NULL, retire, arg) == 0)
+        pthread_detach(retirer);
+    else
+        retire(arg);
+}
+
+void start_reload() {
+    reload_pending = 0;
+    reloading = 1;
+    reload_done = 0;
+    // the reloader decodes binary input the way it was decoded last
+    reloaded = (document_memory){ .encoding = input_encoding,
+                                  .encoding_guessed = encoding_guessed };
+    pthread_create(&reloader, NULL, reload, NULL);
+}
+
+// the index of the child of container that is at the same position as the
+// given child of an older version of it: the member with the same key, or
+// the element with the same index; -1 if there is none
+int find_child(json_value container, const char *key, int index) {
+    unsigned size = container_size(container);
+    if (container.kind == ARRAY || !key)
+        return index < (int)size ? index : -1;
+    if (index < (int)size && strcmp(object_get(container, index).key, key) == 0)
+        return index;
+    for (unsigned i = 0; i < size; i++)
+        if (strcmp(object_get(container, i).key, key) == 0)
+            return i;
+    return -1;
+}
+
+// replaces the document by the reloaded one, going back to the same path of
+// keys and indices as far as it still exists
+void swap_document() {
+    json_value root = reload_result.res;
+    int depth = stack.size;
+    const char **keys = malloc(depth * sizeof(char *));
+    int *indices = malloc(depth * sizeof(int));
+    for (int i = 0; i < depth; i++) {
+        json_pos pos = stack.data[i];
+        keys[i] = pos.value.kind == OBJECT && object_size(pos.value) > 0
+                      ? object_get(pos.value, pos.index).key : NULL;
+        indices[i] = pos.index;
+    }
+    stack.size = 0;
+    stack_push(&stack, (json_pos){ root, 0 });
+    for (int i = 0; i < depth; i++) {
+        json_pos *cur = stack_peek(&stack);
+        if ((cur->value.kind != OBJECT && cur->value.kind != ARRAY) ||
+            container_size(cur->value) == 0)
+            break;
+        int index = find_child(cur->value, keys[i], indices[i]);
+        cur->index = index >= 0 ? index
+                                : min(indices[i], container_size(cur->value) - 1);
+        // the last position is that of the preview, which is not entered
+        if (i < depth - 1 || stack.size == 1)
+            move_to_child();
+        if (index < 0)
+            break;
+    }
+    free(keys);
+    free(indices);
+
+    document_memory old = { document, input_map, input_map_size, ndjson_data,
+                            ndjson_size, input_text, cached, loader_running };
+    retire_later(old);
+
+    document = reloaded.arena;
+    input_map = reloaded.map;
+    input_map_size = reloaded.map_size;
+    input_encoding = reloaded.encoding;
+    encoding_guessed = reloaded.encoding_guessed;
+    ndjson_data = reloaded.ndjson_data;
+    ndjson_size = reloaded.ndjson_size;
+    input_text = reloaded.input_text;
+    cached = (snapshot){ 0 };
+    loader_running = 0;
+    load_result.success = 1;
+    input_corrupt = 0;
+    lazy_failed = 0;
+}
+
+// picks up the outcome of a reload; a failed one leaves the document as it
+// was, with the error shown in the status bar
+void refresh_reload() {
+    if (!reloading || !__atomic_load_n(&reload_done, __ATOMIC_ACQUIRE))
+        return;
+    pthread_join(reloader, NULL);
+    reloading = 0;
+    if (reload_result.success && !reload_corrupt)
+        swap_document();
+    else
+        retire_later(reloaded);
+    pane_resize();
+    if (reload_pending)
+        start_reload();
+}
+
+// the directory of the input file is watched rather than the file itself,
+// since editors often write a new file and rename it over the old one
+void watch_input(const char *filename) {
+    char *dir = strdup(filename);
+    char *slash = strrchr(dir, '/');
+    if (slash) {
+        watch_name = strdup(slash + 1);
+        // the root directory
+        slash[slash == dir] = '\0';
+    }
+    else {
+        watch_name = strdup(filename);
+        strcpy(dir, ".");
+    }
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd >= 0 &&
+        inotify_add_watch(inotify_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        close(inotify_fd);
+        inotify_fd = -1;
+    }
+    free(dir);
+}
+
+// reloads the input once it has been written to or replaced
+void on_input_changed() {
+    char events[4096]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    int changed = 0;
+    ssize_t n;
+    while ((n = read(inotify_fd, events, sizeof(events))) > 0) {
+        for (char *p = events; p < events + n;) {
+            struct inotify_event *e = (struct inotify_event *)p;
+            if (e->len && strcmp(e->name, watch_name) == 0)
+                changed = 1;
+            p += sizeof(struct inotify_event) + e->len;
+        }
+    }
+    if (!changed)
+        return;
+    // the initial parse or an ongoing reload is finished first
+    if (loading || reloading)
+        reload_pending = 1;
+    else
+        start_reload();
+}
+
+// called on the loader thread
+void wake_ui() {
+    static struct timespec last;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long elapsed_ms = (now.tv_sec - last.tv_sec) * 1000 +
+                      (now.tv_nsec - last.tv_nsec) / 1000000;
+    if (elapsed_ms < 100 && !progress.done)
+        return;
+    last = now;
+    write(wake_pipe[1], "", 1);
+}
+
+// looks up the snapshot of a large enough input
+void open_snapshot() {
+    if (!use_snapshot || input_format != UNCOMPRESSED ||
+        !S_ISREG(input_stat.st_mode) || input_stat.st_size < SNAPSHOT_MIN_SIZE)
+        return;
+    if (!mk_snapshot_key(&snapshot_input, input_filename, &input_stat,
+                         input_fd))
+        return;
+    snapshot_path = snapshot_cache_path(&snapshot_input);
+    if (snapshot_path)
+        snapshot_open(snapshot_path, &snapshot_input, &cached);
+}
+
+void *load(void *arg) {
+    load_result = parse_json_progress(input_map, input_map_size, input,
+                                      &progress);
+    // the interface is already using the document at this point, which is
+    // not modified anymore
+    if (load_result.success && snapshot_path)
+        snapshot_write(snapshot_path, &snapshot_input, load_result.res,
+                       &progress.cancel);
+    return NULL;
+}
+
+void start_loader() {
+    progress.root = mk_null_value();
+    progress.notify = wake_ui;
+    clock_gettime(CLOCK_MONOTONIC, &load_start);
+    loading = 1;
+    loader_running = 1;
+    pthread_create(&loader, NULL, load, NULL);
+}
+
+// picks up the children of the top-level container that the loader has
+// published since the last call; must hold progress.lock
+void refresh_root() {
+    if (!loading)
+        return;
+    stack.data[0].value = progress.root;
+    if (stack.size == 1) {
+        move_to_child();
+        pane_resize();
+    }
+    if (progress.done) {
+        loading = 0;
+        document = load_result.arena;
+        close_input();
+        if (reload_pending)
+            start_reload();
+    }
+}
+
+void loop() {
+    // poll() skips the inotify descriptor unless following
+    struct pollfd fds[3] = {
+        { .fd = tty, .events = POLLIN },
+        { .fd = wake_pipe[0], .events = POLLIN },
+        { .fd = inotify_fd, .events = POLLIN }
+    };
+    while (1) {
+        // while loading, redraw regularly to update the progress indicator
+        int ready = poll(fds, 3, loading ? 250 : -1);
+        int quit = 0;
+        pthread_mutex_lock(&progress.lock);
+        refresh_root();
+        refresh_reload();
+        if (ready > 0 && fds[2].revents & POLLIN) {
+            if (follow)
+                follow_input();
+            else
+                on_input_changed();
+        }
+        if (ready <= 0 || fds[1].revents & POLLIN ||
+            fds[2].revents & POLLIN) {
+            char buf[64];
+            if (ready > 0)
+                read(wake_pipe[0], buf, sizeof(buf));
+            if (resized) {
+                resized = 0;
+                pane_resize();
+            }
+            draw();
+        }
+        if (ready > 0 && fds[0].revents & POLLIN) {
+            char in[6];
+            int num_read = read(tty, &in, 6);
+            if (num_read > 0)
+                quit = handle_input(in, num_read);
+        }
+        pthread_mutex_unlock(&progress.lock);
+        if (quit)
+            return;
     }
 }
 
@@ -772,14 +1725,40 @@ void on_term(int i) {
 }
 
 void on_resize() {
-    pane_resize();
-    draw();
+    resized = 1;
+    write(wake_pipe[1], "", 1);
     signal(SIGWINCH, on_resize);
 }
 
 void fin() {
-    json_value top = stack_peekn(&stack, stack.size - 1)->value;
-    value_free(top);
+    // quitting cancels a parse still in progress; its memory is left for
+    // the process exit to reclaim
+    if (loading)
+        __atomic_store_n(&progress.cancel, 1, __ATOMIC_RELAXED);
+    else {
+        // abandons writing the snapshot
+        if (loader_running) {
+            __atomic_store_n(&progress.cancel, 1, __ATOMIC_RELAXED);
+            pthread_join(loader, NULL);
+        }
+        if (ndjson_data)
+            ndjson_release(ndjson_data, ndjson_size);
+        arena_free(document);
+        close_input();
+        if (input_map)
+            munmap(input_map, follow ? FOLLOW_MAP_SIZE : input_map_size);
+        if (follow_fd >= 0)
+            close(follow_fd);
+        buffer_free(&input_text);
+    }
+    // a reload still in progress is left for the process exit to reclaim
+    if (inotify_fd >= 0)
+        close(inotify_fd);
+    free(watch_name);
+    snapshot_close(&cached);
+    snapshot_key_free(&snapshot_input);
+    free(snapshot_path);
+    stack_free(&stack);
 
     for (int i = 0; i < NUM_PANES; i++) {
         pane *p = &window.panes[i];
@@ -789,7 +1768,7 @@ void fin() {
     }
 
     if (term_initialized) {
-        tcsetattr(STDIN_FILENO, TCSAFLUSH, &saved_term);
+        tcsetattr(tty, TCSAFLUSH, &saved_term);
         printf(CURS_SHOW);
         printf(ALT_BUF_DIS);
         printf(TRACKING_DIS);
@@ -801,23 +1780,102 @@ void fin() {
 #endif
 }
 
+// a lazily parsed container was malformed; it is shown empty, and the error
+// once the interface is drawn again
+void on_lazy_parse_error(parse_result pr) {
+    lazy_error = pr;
+    lazy_failed = 1;
+    write(wake_pipe[1], "", 1);
+}
+
+
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [--lazy] [--jobs N] [--no-snapshot] "
+                    "[--ndjson] [--follow] [--reload] [--check] "
+                    "[<JSON, CBOR or MessagePack input file> | -]\n", prog);
+    exit(EXIT_FAILURE);
+}
 
 int main(int argc, char **argv) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <JSON input file>\n", argv[0]);
-        exit(EXIT_FAILURE);
+    static struct option options[] = {
+        { "lazy", no_argument, NULL, 'l' },
+        { "jobs", required_argument, NULL, 'j' },
+        { "no-snapshot", no_argument, NULL, 's' },
+        { "ndjson", no_argument, NULL, 'n' },
+        { "follow", no_argument, NULL, 'f' },
+        { "reload", no_argument, NULL, 'r' },
+        { "check", no_argument, NULL, 'c' },
+        { 0 }
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "lj:nfc", options, NULL)) != -1) {
+        switch (opt) {
+            case 'l':
+                lazy = 1;
+                break;
+            case 'j': {
+                // 0 stands for one job per CPU
+                char *end;
+                long n = strtol(optarg, &end, 10);
+                if (end == optarg || *end || n < 0 || n > INT_MAX) {
+                    fprintf(stderr, "Invalid number of jobs: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                jobs = n > 0 ? n : sysconf(_SC_NPROCESSORS_ONLN);
+                break;
+            }
+            case 's':
+                use_snapshot = 0;
+                break;
+            case 'n':
+                ndjson = 1;
+                break;
+            case 'f':
+                follow = 1;
+                ndjson = 1;
+                break;
+            case 'r':
+                watch = 1;
+                break;
+            case 'c':
+                check = 1;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    // without a file (or with -), the input is read from stdin
+    const char *filename = NULL;
+    if (optind == argc - 1 && strcmp(argv[optind], "-") != 0)
+        filename = argv[optind];
+    else if (optind < argc - 1 || (optind == argc && isatty(STDIN_FILENO)))
+        usage(argv[0]);
+    input_filename = filename ? filename : "<stdin>";
+    if (filename && is_ndjson_filename(filename))
+        ndjson = 1;
+    // the snapshot of a file is found by its path
+    if (!filename)
+        use_snapshot = 0;
+
+    if (check) {
+        follow = 0;
+        signal(SIGPIPE, SIG_IGN);
+        exit(check_input(filename));
     }
-    input_filename = argv[1];
 
-    if(!isatty(STDIN_FILENO)){
-      fprintf(stderr, "Not a terminal\n");
-      exit(EXIT_FAILURE);
+    if (!filename || !isatty(STDIN_FILENO))
+        tty = open("/dev/tty", O_RDWR | O_CLOEXEC);
+    if (tty < 0 || !isatty(tty)) {
+        fprintf(stderr, "Not a terminal\n");
+        exit(EXIT_FAILURE);
     }
 
     atexit(fin);
     // TODO: use sigaction for all signal handling
     signal(SIGINT, on_term);
     signal(SIGTERM, on_term);
+    // a decompressor writing to a closed pipe fails with EPIPE instead
+    signal(SIGPIPE, SIG_IGN);
 #ifndef DEBUG
     signal(SIGABRT, on_term);
 #endif
@@ -826,28 +1884,84 @@ int main(int argc, char **argv) {
     trace = fopen("trace.txt", "w");
 #endif
 
-    FILE *f = fopen(input_filename, "r");
-    if (!f) {
-        fprintf(stderr, "Error reading input file\n");
+    if (pipe(wake_pipe) < 0) {
+        perror("pipe");
         exit(EXIT_FAILURE);
     }
-    parse_result pr = parse_json(f);
-    fclose(f);
-    if (!pr.success) {
-        print_error(stderr, pr);
+    fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK);
+
+    open_input(filename);
+    if (follow && (!filename || follow_fd < 0)) {
+        fprintf(stderr, "--follow needs an uncompressed file\n");
         exit(EXIT_FAILURE);
     }
+    detect_input_encoding(filename);
+    // binary input decodes about as fast as its snapshot would be read
+    if (!ndjson && input_encoding == JSON_TEXT)
+        open_snapshot();
+    on_lazy_error = on_lazy_parse_error;
+    if (ndjson) {
+        parse_result pr = parse_ndjson_input();
+        if (input_corrupt) {
+            fprintf(stderr, "Error: corrupt %s input\n",
+                    compression_name(input_format));
+            exit(EXIT_FAILURE);
+        }
+        if (!pr.success) {
+            print_error(stderr, pr);
+            exit(EXIT_FAILURE);
+        }
+        document = pr.arena;
+        stack_push(&stack, (json_pos){pr.res, 0});
+        move_to_child();
+        if (follow) {
+            inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+            if (inotify_fd < 0 ||
+                inotify_add_watch(inotify_fd, filename, IN_MODIFY) < 0) {
+                perror("inotify");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    else if (cached.data) {
+        lazy = 0;
+        close_input();
+        stack_push(&stack, (json_pos){cached.root, 0});
+        move_to_child();
+    }
+    else if (lazy || jobs > 1 || input_encoding != JSON_TEXT) {
+        parse_result pr = input_encoding != JSON_TEXT ? parse_binary_input()
+                                                      : parse_input();
+        if (input_corrupt) {
+            fprintf(stderr, "Error: corrupt %s input\n",
+                    compression_name(input_format));
+            exit(EXIT_FAILURE);
+        }
+        if (!pr.success) {
+            print_error(stderr, pr);
+            exit(EXIT_FAILURE);
+        }
+        document = pr.arena;
+        stack_push(&stack, (json_pos){pr.res, 0});
+        move_to_child();
+    }
+    else {
+        start_loader();
+        stack_push(&stack, (json_pos){progress.root, 0});
+    }
 
-    json_value top = pr.res;
-
-    stack_push(&stack, (json_pos){top, 0});
-    move_to_child();
+    if (watching(filename))
+        watch_input(filename);
 
     term_setup();
-    pane_resize();
     signal(SIGWINCH, on_resize);
 
+    pthread_mutex_lock(&progress.lock);
+    refresh_root();
+    pane_resize();
     draw();
+    pthread_mutex_unlock(&progress.lock);
 
     loop();
 }
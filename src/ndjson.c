@@ -0,0 +1,323 @@
+#include <string.h>
+#include <pthread.h>
+#include "ndjson.h"
+
+#define RECORD_BUCKETS (2 * RECORD_CACHE_SIZE)
+
+// a parsed record; entries are referred to by their index plus one, so
+// that zero means none
+typedef struct {
+    const char *line;
+    arena *arena;
+    json_value value;
+    // the neighbours in the order of use, most recent first; unused entries
+    // are linked through next
+    int prev, next;
+    // the next entry in the same bucket
+    int chain;
+} record_entry;
+
+// the documents that records belong to, so that the end of a line and the
+// line number of an error can be found
+typedef struct {
+    const char *data;
+    // the part of data that has been indexed, and the lines in it
+    size_t len;
+    int lines;
+    // where scalars and the top-level array are allocated
+    arena *arena;
+    // shared by all records, so that their keys can be compared by address
+    intern_table *keys;
+    // the number of records that the top-level array has room for
+    unsigned capacity;
+} ndjson_document;
+
+static struct {
+    pthread_mutex_t lock;
+    record_entry entries[RECORD_CACHE_SIZE];
+    int buckets[RECORD_BUCKETS];
+    // the number of entries that have ever been used
+    int size;
+    int first, last, unused;
+    const char *pinned;
+    // grows as needed, and only while holding lock
+    ndjson_document *documents;
+    int num_documents, documents_capacity;
+} cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static inline int is_blank(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+static inline const char *skip_blanks(const char *p, const char *end) {
+    while (p < end && is_blank(*p))
+        p++;
+    return p;
+}
+
+static inline record_entry *entry(int i) {
+    return &cache.entries[i - 1];
+}
+
+static inline int *bucket(const char *line) {
+    return &cache.buckets[((uintptr_t)line * 0x9e3779b97f4a7c15u >> 32) %
+                          RECORD_BUCKETS];
+}
+
+static void unlink_entry(int i) {
+    record_entry *e = entry(i);
+    if (e->prev)
+        entry(e->prev)->next = e->next;
+    else
+        cache.first = e->next;
+    if (e->next)
+        entry(e->next)->prev = e->prev;
+    else
+        cache.last = e->prev;
+}
+
+static void push_front(int i) {
+    record_entry *e = entry(i);
+    e->prev = 0;
+    e->next = cache.first;
+    if (cache.first)
+        entry(cache.first)->prev = i;
+    else
+        cache.last = i;
+    cache.first = i;
+}
+
+static void remove_entry(int i) {
+    record_entry *e = entry(i);
+    int *link = bucket(e->line);
+    while (*link != i)
+        link = &entry(*link)->chain;
+    *link = e->chain;
+    unlink_entry(i);
+    arena_free(e->arena);
+    e->arena = NULL;
+    e->line = NULL;
+}
+
+// an unused entry, or else the least recently used one that is not pinned
+static int take_entry() {
+    int i = cache.unused;
+    if (i)
+        cache.unused = entry(i)->next;
+    else if (cache.size < RECORD_CACHE_SIZE)
+        i = ++cache.size;
+    else {
+        i = cache.last;
+        while (entry(i)->line == cache.pinned)
+            i = entry(i)->prev;
+        remove_entry(i);
+    }
+    return i;
+}
+
+static ndjson_document *document_at(const char *data) {
+    for (int i = 0; i < cache.num_documents; i++)
+        if (cache.documents[i].data == data)
+            return &cache.documents[i];
+    return NULL;
+}
+
+static ndjson_document *find_document(const char *line) {
+    for (int i = 0; i < cache.num_documents; i++) {
+        ndjson_document *doc = &cache.documents[i];
+        if (line >= doc->data && line < doc->data + doc->len)
+            return doc;
+    }
+    return NULL;
+}
+
+// parses a line into the arena of an entry; a malformed record is left empty
+static parse_result parse_record(const char *line, record_entry *e) {
+    ndjson_document *doc = find_document(line);
+    const char *end = doc->data + doc->len;
+    const char *eol = memchr(line, '\n', end - line);
+    if (!eol)
+        eol = end;
+    // roughly what the values of a record take up
+    e->arena = mk_arena_sized(2 * (eol - line) + 256);
+    parse_result pr = parse_json_in(line, eol - line, e->arena, doc->keys);
+    if (pr.success) {
+        e->value = pr.res;
+        return pr;
+    }
+
+    for (const char *p = doc->data; (p = memchr(p, '\n', line - p)); p++)
+        pr.error.line++;
+    buffer empty = { NULL, 0, 0 };
+    e->value = *line == '{' ? mk_object_value(empty) : mk_array_value(empty);
+    return pr;
+}
+
+json_value record_force(json_value record) {
+    pthread_mutex_lock(&cache.lock);
+    parse_result pr = { .success = 1 };
+    int i = *bucket(record.record);
+    while (i && entry(i)->line != record.record)
+        i = entry(i)->chain;
+    if (i)
+        unlink_entry(i);
+    else {
+        i = take_entry();
+        record_entry *e = entry(i);
+        pr = parse_record(record.record, e);
+        e->line = record.record;
+        int *head = bucket(e->line);
+        e->chain = *head;
+        *head = i;
+    }
+    push_front(i);
+    json_value res = entry(i)->value;
+    pthread_mutex_unlock(&cache.lock);
+    if (!pr.success && on_lazy_error)
+        on_lazy_error(pr);
+    return res;
+}
+
+void ndjson_pin(json_value record) {
+    if (record.lazy != LAZY_RECORD)
+        return;
+    pthread_mutex_lock(&cache.lock);
+    cache.pinned = record.record;
+    pthread_mutex_unlock(&cache.lock);
+}
+
+// a line holding a scalar, or an empty container, is parsed right away
+static parse_result parse_line(const char *line, const char *eol, arena *a,
+                               intern_table *keys) {
+    const char *p = skip_blanks(line, eol);
+    if (*p == '{' || *p == '[') {
+        const char *q = skip_blanks(p + 1, eol);
+        if (q == eol || *q != (*p == '{' ? '}' : ']') ||
+            skip_blanks(q + 1, eol) != eol)
+            return (parse_result){ .success = 1, .res = mk_record_value(
+                *p == '{' ? OBJECT : ARRAY, p) };
+    }
+    return parse_json_in(line, eol - line, a, keys);
+}
+
+// the number of records that the lines of data from from to len can hold
+// at most, so that their index is allocated once, at its final place
+static size_t count_lines(const char *data, size_t from, size_t len) {
+    size_t n = 1;
+    const char *end = data + len;
+    for (const char *p = data + from; (p = memchr(p, '\n', end - p)); p++)
+        n++;
+    return n;
+}
+
+// indexes the lines of data from from to len, adding their records to
+// elements, which has room for them, after the *n already there; lines are
+// counted in *line; a malformed line fails the whole run, unless skip is
+// set, in which case it is left out and only the first such error is
+// returned
+static parse_result index_lines(const char *data, size_t from, size_t len,
+                                int *line, json_value *elements, unsigned *n,
+                                arena *a, intern_table *keys, int skip) {
+    parse_result res = { .success = 1 };
+    const char *end = data + len;
+    for (const char *p = data + from; p < end; ++*line) {
+        const char *eol = memchr(p, '\n', end - p);
+        if (!eol)
+            eol = end;
+        if (skip_blanks(p, eol) < eol) {
+            parse_result pr = parse_line(p, eol, a, keys);
+            if (pr.success)
+                elements[(*n)++] = pr.res;
+            else if (res.success) {
+                pr.error.line = *line + 1;
+                res = pr;
+                if (!skip)
+                    return res;
+            }
+        }
+        p = eol + 1;
+    }
+    return res;
+}
+
+parse_result parse_ndjson(const char *data, size_t len) {
+    arena *a = mk_arena();
+    intern_table *keys = mk_intern_table(a);
+    size_t capacity = count_lines(data, 0, len);
+    json_value *elements = arena_alloc(a, capacity * sizeof(json_value));
+    unsigned n = 0;
+    int lines = 0;
+    parse_result pr = index_lines(data, 0, len, &lines, elements, &n, a, keys,
+                                  0);
+    if (!pr.success) {
+        arena_free(a);
+        pr.arena = NULL;
+        return pr;
+    }
+
+    pthread_mutex_lock(&cache.lock);
+    if (cache.num_documents == cache.documents_capacity) {
+        cache.documents_capacity = cache.documents_capacity
+                                       ? 2 * cache.documents_capacity : 4;
+        cache.documents = realloc(cache.documents, cache.documents_capacity *
+                                                   sizeof(ndjson_document));
+    }
+    cache.documents[cache.num_documents++] = (ndjson_document){
+        data, len, lines, a, keys, capacity };
+    pthread_mutex_unlock(&cache.lock);
+    buffer res = { (char *)elements, n * sizeof(json_value),
+                   n * sizeof(json_value) };
+    return (parse_result){ .success = 1, .res = mk_array_value(res),
+                           .arena = a };
+}
+
+parse_result ndjson_append(const char *data, size_t len, json_value *array) {
+    pthread_mutex_lock(&cache.lock);
+    ndjson_document d = *document_at(data);
+    pthread_mutex_unlock(&cache.lock);
+
+    // the array doubles in size, so that appending takes amortized constant
+    // time per record; what it outgrows stays in the arena
+    size_t needed = array->size + count_lines(data, d.len, len);
+    if (needed > d.capacity) {
+        d.capacity = 2 * d.capacity > needed ? 2 * d.capacity : needed;
+        json_value *grown = arena_alloc(d.arena,
+                                        d.capacity * sizeof(json_value));
+        if (array->size)
+            memcpy(grown, array->elements, array->size * sizeof(json_value));
+        array->elements = grown;
+    }
+    unsigned n = array->size;
+    parse_result pr = index_lines(data, d.len, len, &d.lines, array->elements,
+                                  &n, d.arena, d.keys, 1);
+    array->size = n;
+
+    pthread_mutex_lock(&cache.lock);
+    ndjson_document *doc = document_at(data);
+    doc->len = len;
+    doc->lines = d.lines;
+    doc->capacity = d.capacity;
+    pthread_mutex_unlock(&cache.lock);
+    if (pr.success)
+        pr.res = *array;
+    return pr;
+}
+
+void ndjson_release(const char *data, size_t len) {
+    pthread_mutex_lock(&cache.lock);
+    for (int i = cache.first; i;) {
+        int next = entry(i)->next;
+        if (entry(i)->line >= data && entry(i)->line < data + len) {
+            remove_entry(i);
+            entry(i)->next = cache.unused;
+            cache.unused = i;
+        }
+        i = next;
+    }
+    if (cache.pinned >= data && cache.pinned < data + len)
+        cache.pinned = NULL;
+    ndjson_document *doc = document_at(data);
+    if (doc)
+        *doc = cache.documents[--cache.num_documents];
+    pthread_mutex_unlock(&cache.lock);
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stddef.h>
+#include "json.h"
+#include "parse.h"
+
+// the number of parsed records that are kept around at any time
+#define RECORD_CACHE_SIZE 4096
+
+// presents newline-delimited JSON as a top-level array with an element per
+// non-blank line; the lines are only indexed, and those holding objects or
+// arrays are parsed on demand by value_force(), which caches the most
+// recently used ones; data must outlive the result
+parse_result parse_ndjson(const char *data, size_t len);
+
+// indexes the lines that have been added to data since it was parsed (or
+// last appended to), now that it is len bytes long, and appends their records
+// to array, the result of parse_ndjson(); the time taken only depends on the
+// number of lines added; malformed lines are skipped, and the first of them
+// is reported as the error
+parse_result ndjson_append(const char *data, size_t len, json_value *array);
+
+// forgets the records of data; to be called before releasing data or the
+// result of parse_ndjson()
+void ndjson_release(const char *data, size_t len);
+
+// keeps a record (an element of the top-level array) and everything it
+// refers to from being evicted, until another record is pinned
+void ndjson_pin(json_value record);
+
+// parses a record, or looks it up in the cache; see value_force()
+json_value record_force(json_value record);
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdint.h>
+
+// converts w * 10^q to the nearest double, exactly; returns 0 if this
+// cannot be done without looking at the decimal digits themselves
+int decimal_to_double(uint64_t w, int q, int negative, double *res);
+
+// writes the shortest representation of x that reads back as x
+void format_number(char *dest, unsigned size, double x);
@@ -1,69 +1,245 @@
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <setjmp.h>
+#include <pthread.h>
+#include <inttypes.h>
 #include "parse.h"
+#include "index.h"
+#include "number.h"
+#include "ndjson.h"
 #include "trace.h"
 
 typedef struct parse_error parse_error;
 typedef struct parse_state parse_state;
 
+#define CHUNK_SIZE (1 << 16)
+#define SCRATCH_SIZE (1 << 12)
+
+// a container whose children are being parsed
+typedef struct {
+    int kind;
+    // the character that ends the container; EOF for runs of children
+    // without brackets, see parse_run()
+    int close;
+    // where the children start in the scratch stack of the parse state
+    unsigned start;
+    // the key of the member whose value is being parsed
+    char *key;
+} parse_frame;
+
 struct parse_state {
+    // the current window of input; for in-memory input this is everything
+    const char *p, *end;
+    // fallback for inputs that cannot be mapped: the window is refilled
+    // from f into chunk whenever it is exhausted, or moved to the next block
+    // of reader
     FILE *f;
-    int consumed;
+    char *chunk;
+    reader *reader;
+    // structural positions of the block of input around p
+    struct_index idx;
+    // when set, nested containers are only skipped over; see value_force()
+    int lazy;
+    // when set, the input is only validated: no values are kept, so that
+    // memory use depends on nesting depth alone
+    int check;
+    // the containers enclosing the current position, innermost last
+    parse_frame *stack;
+    int depth, stack_capacity;
+    // the children of all open containers, those of the innermost one last;
+    // they are copied to the arena at their exact size once it is closed
+    buffer scratch;
+    // the children of the top-level container while it is being observed,
+    // kept apart from scratch since observers read them concurrently
+    buffer published;
+    // where the document is allocated
+    arena *arena;
+    // the object keys of the document
+    intern_table *keys;
+    // the digits of numbers that need to be converted by strtod
+    buffer digits;
+    // observers of a background parse, if any
+    parse_progress *progress;
+    // where the window starts, its offset in the input, and the line and
+    // column there; positions within the window are only worked out when
+    // parsing fails, see locate()
+    const char *window;
+    size_t window_offset;
     int line, col;
-    char tok;
+    // the byte at p, as an unsigned char, or EOF at the end of input
+    int tok;
+    // why parsing failed, see parse_result
+    int error_kind;
     jmp_buf on_err;
 };
 
-static inline char cur(const parse_state *ps) {
+// the significand of a number, as it is being read
+typedef struct {
+    // the first 19 significant digits; all of them are kept in the digits
+    // of the parse state if there are more
+    uint64_t w;
+    int ndigits, exp, negative;
+} decimal;
+
+// classes of characters, looked up in char_class
+enum {
+    CC_WS = 1,
+    CC_DIGIT = 2,
+    CC_HEX = 4,
+    // the characters that may follow a backslash
+    CC_ESCAPE = 8,
+    // the characters that make a number a double
+    CC_FRACTION = 16
+};
+
+#define DIGIT_CLASS (CC_DIGIT | CC_HEX)
+
+static const uint8_t char_class[256] = {
+    [' '] = CC_WS, ['\n'] = CC_WS, ['\r'] = CC_WS, ['\t'] = CC_WS,
+    ['0'] = DIGIT_CLASS, ['1'] = DIGIT_CLASS, ['2'] = DIGIT_CLASS,
+    ['3'] = DIGIT_CLASS, ['4'] = DIGIT_CLASS, ['5'] = DIGIT_CLASS,
+    ['6'] = DIGIT_CLASS, ['7'] = DIGIT_CLASS, ['8'] = DIGIT_CLASS,
+    ['9'] = DIGIT_CLASS,
+    ['A'] = CC_HEX, ['B'] = CC_HEX, ['C'] = CC_HEX, ['D'] = CC_HEX,
+    ['E'] = CC_HEX | CC_FRACTION, ['F'] = CC_HEX,
+    ['a'] = CC_HEX, ['b'] = CC_HEX | CC_ESCAPE, ['c'] = CC_HEX,
+    ['d'] = CC_HEX, ['e'] = CC_HEX | CC_FRACTION, ['f'] = CC_HEX | CC_ESCAPE,
+    ['n'] = CC_ESCAPE, ['r'] = CC_ESCAPE, ['t'] = CC_ESCAPE,
+    ['"'] = CC_ESCAPE, ['\\'] = CC_ESCAPE, ['/'] = CC_ESCAPE,
+    ['.'] = CC_FRACTION
+};
+
+// the value of hex digits
+static const uint8_t hex_digit[256] = {
+    ['0'] = 0, ['1'] = 1, ['2'] = 2, ['3'] = 3, ['4'] = 4, ['5'] = 5,
+    ['6'] = 6, ['7'] = 7, ['8'] = 8, ['9'] = 9,
+    ['A'] = 10, ['B'] = 11, ['C'] = 12, ['D'] = 13, ['E'] = 14, ['F'] = 15,
+    ['a'] = 10, ['b'] = 11, ['c'] = 12, ['d'] = 13, ['e'] = 14, ['f'] = 15
+};
+
+// what a scalar starting with a given character is, see parse_scalar()
+enum { VS_INVALID, VS_CONTAINER, VS_STRING, VS_NUMBER, VS_TRUE, VS_FALSE,
+       VS_NULL };
+
+static const uint8_t value_start[256] = {
+    ['{'] = VS_CONTAINER, ['['] = VS_CONTAINER, ['"'] = VS_STRING,
+    ['-'] = VS_NUMBER, ['0'] = VS_NUMBER, ['1'] = VS_NUMBER,
+    ['2'] = VS_NUMBER, ['3'] = VS_NUMBER, ['4'] = VS_NUMBER,
+    ['5'] = VS_NUMBER, ['6'] = VS_NUMBER, ['7'] = VS_NUMBER,
+    ['8'] = VS_NUMBER, ['9'] = VS_NUMBER,
+    ['t'] = VS_TRUE, ['f'] = VS_FALSE, ['n'] = VS_NULL
+};
+
+static inline int cur(const parse_state *ps) {
     return ps->tok;
 }
 
-static void advance(parse_state *ps) {
-    if (ps->tok == '\n') {
-        ps->line++;
-        ps->col = 1;
-    }
+static int refill(parse_state *ps) {
+    if (!ps->reader && !ps->f)
+        return 0;
+    // the window is about to be released
+    int line = ps->line, col = ps->col;
+    count_position(ps->window, ps->end, &line, &col);
+    size_t n;
+    if (ps->reader)
+        n = reader_next(ps->reader, &ps->p);
     else {
-        ps->col++;
+        n = fread(ps->chunk, 1, CHUNK_SIZE, ps->f);
+        // the last window is kept, so that errors at the end of input can
+        // be shown in context
+        if (n == 0)
+            return 0;
+        ps->p = ps->chunk;
     }
-    ps->tok = fgetc(ps->f);
-    ps->consumed++;
+    ps->line = line;
+    ps->col = col;
+    ps->window_offset += ps->end - ps->window;
+    ps->window = ps->p;
+    ps->end = ps->p + n;
+    ps->idx.base = ps->idx.end = NULL;
+    return n > 0;
 }
 
-// FIXME: this needs to free allocated memory
+// reads the byte at p, refilling the window if it has been exhausted
+static inline void load(parse_state *ps) {
+    if (ps->p < ps->end || refill(ps))
+        ps->tok = (unsigned char)*ps->p;
+    else
+        ps->tok = EOF;
+}
+
+// moves forward to target within the current window
+static inline void skip_to(parse_state *ps, const char *target) {
+    ps->p = target;
+    load(ps);
+}
+
+static inline void advance(parse_state *ps) {
+    if (ps->p < ps->end)
+        ps->p++;
+    load(ps);
+}
+
+// everything allocated so far is released by the caller of parse(), see
+// parse_document()
 static void error(parse_state *ps) {
     longjmp(ps->on_err, 1);
 }
 
-static inline void tracep(parse_state *ps, const char *msg) {
+// fails at pos, within the current window, because of the byte c there
+static void fail(parse_state *ps, const char *pos, char c, int kind) {
+    ps->p = pos;
+    ps->tok = (unsigned char)c;
+    ps->error_kind = kind;
+    error(ps);
+}
+
+static inline void check_utf8(parse_state *ps, const char *p,
+                              const char *end) {
+    // most strings are short and ASCII, which is checked for in place
+    for (uint64_t w; end - p >= 8; p += 8) {
+        memcpy(&w, p, 8);
+        if (w & 0x8080808080808080u)
+            break;
+    }
+    while (p < end && (unsigned char)*p < 0x80)
+        p++;
+    if (p == end)
+        return;
+    const char *bad = validate_utf8(p, end);
+    if (bad < end)
+        fail(ps, bad, *bad, ENCODING_ERROR);
+}
+
 #ifdef DEBUG_PARSE
-    TRACE("%5d,%3d ", ps->line, ps->col);
+static void tracep(parse_state *ps, const char *msg) {
+    TRACE("%10zu ", ps->window_offset + (ps->p - ps->window));
     char c = cur(ps);
     if (c == '\n')
         TRACE("\\n %16s\n", msg);
-    else if (c == '\n')
-        TRACE("\\r %16s\r", msg);
-    else if (c == '\n')
-        TRACE("\\t %16s\t", msg);
+    else if (c == '\r')
+        TRACE("\\r %16s\n", msg);
+    else if (c == '\t')
+        TRACE("\\t %16s\n", msg);
     else
         TRACE("%2c %16s\n", c, msg);
-#endif
 }
+#else
+// compiled out along with its arguments
+#define tracep(ps, msg)
+#endif
 
-static inline int peek(parse_state *ps, char tok) {
+static inline int peek(parse_state *ps, int tok) {
     return ps->tok == tok;
 }
 
-static int peek_anyof(parse_state *ps, char *tok_set) {
-    for (char *c = tok_set; *c != '\0'; c++) {
-        if (cur(ps) == *c)
-            return *c;
-    }
-    return 0;
+// whether the current character is in any of the classes in cls
+static inline int peek_class(parse_state *ps, int cls) {
+    return char_class[(unsigned char)ps->tok] & cls;
 }
 
-static int consume(parse_state *ps, char tok) {
+static int consume(parse_state *ps, int tok) {
     if (peek(ps, tok)) {
         tracep(ps, "");
         advance(ps);
@@ -72,17 +248,7 @@ static int consume(parse_state *ps, char tok) {
     return 0;
 }
 
-static char consume_anyof(parse_state *ps, char *tok_set) {
-    char c;
-    if ((c = peek_anyof(ps, tok_set))) {
-        tracep(ps, "");
-        advance(ps);
-        return c;
-    }
-    return 0;
-}
-
-static int parse_char(parse_state *ps, char tok) {
+static int parse_char(parse_state *ps, int tok) {
     tracep(ps, "char");
     if (consume(ps, tok))
         return 1;
@@ -90,41 +256,76 @@ static int parse_char(parse_state *ps, char tok) {
     return 0;
 }
 
-static int parse_anyof(parse_state *ps, char *tok_str) {
-    tracep(ps, "char");
-    char c;
-    if ((c = consume_anyof(ps, tok_str)))
-        return c;
-    error(ps);
-    return 0;
-}
-
+static void report_progress(parse_state *);
+static void publish_member(parse_state *, json_member);
+static void publish_element(parse_state *, json_value);
 static json_value parse_top(parse_state *);
-static json_value parse_value(parse_state *);
-static json_object parse_object(parse_state *);
-static json_object parse_members(parse_state *);
-static json_member parse_member(parse_state *);
-static json_array parse_array(parse_state *);
-static json_array parse_elements(parse_state *);
 static json_value parse_element(parse_state *);
-static char *parse_string(parse_state *);
-static char *parse_characters(parse_state *);
-static int parse_character(parse_state *, char *);
-static int parse_escape(parse_state *, char *);
+static json_value parse_run(parse_state *, int);
+static json_value parse_nested(parse_state *, int);
+static void open_container(parse_state *, int, int);
+static json_value close_container(parse_state *);
+static json_value parse_scalar(parse_state *);
+static json_value parse_lazy(parse_state *);
+static json_value parse_string(parse_state *);
+static char *parse_key(parse_state *);
+static json_value parse_characters(parse_state *);
+static json_value parse_characters_stream(parse_state *);
+static int copy_escape(parse_state *, char *);
 static char parse_hex(parse_state *);
-static float parse_number(parse_state *);
-static int parse_integer(parse_state *);
-static int parse_pos_integer(parse_state *ps);
-static int parse_digits(parse_state *);
-static int parse_digit(parse_state *);
-static int parse_fraction(parse_state *);
-static int parse_exponent(parse_state *);
-static int parse_sign(parse_state *);
+static json_value parse_number(parse_state *);
+static void start_digits(parse_state *, decimal *);
+static void parse_integer(parse_state *, decimal *);
+static void parse_digits(parse_state *, decimal *, int);
+static void parse_fraction(parse_state *, decimal *);
+static void parse_exponent(parse_state *, decimal *);
 static void parse_ws(parse_state *);
 static void parse_true(parse_state *);
 static void parse_false(parse_state *);
 static void parse_null(parse_state *);
 
+static void report_progress(parse_state *ps) {
+    if (!ps->progress)
+        return;
+    __atomic_store_n(&ps->progress->consumed,
+                     ps->window_offset + (ps->p - ps->window),
+                     __ATOMIC_RELAXED);
+    if (__atomic_load_n(&ps->progress->cancel, __ATOMIC_RELAXED))
+        error(ps);
+}
+
+// appends to the top-level container while it is being observed
+static void publish(parse_state *ps, const void *child, unsigned size) {
+    parse_progress *pp = ps->progress;
+    pthread_mutex_lock(&pp->lock);
+    if (child)
+        buffer_append(&ps->published, child, size);
+    pp->root = ps->stack[0].kind == OBJECT ? mk_object_value(ps->published)
+                                           : mk_array_value(ps->published);
+    pthread_mutex_unlock(&pp->lock);
+    report_progress(ps);
+    if (pp->notify)
+        pp->notify();
+}
+
+static void publish_member(parse_state *ps, json_member member) {
+    if (ps->check)
+        return;
+    if (ps->progress && ps->depth == 1)
+        publish(ps, &member, sizeof(json_member));
+    else
+        object_append(&ps->scratch, member);
+}
+
+static void publish_element(parse_state *ps, json_value element) {
+    if (ps->check)
+        return;
+    if (ps->progress && ps->depth == 1)
+        publish(ps, &element, sizeof(json_value));
+    else
+        array_append(&ps->scratch, element);
+}
+
 static json_value parse_top(parse_state *ps) {
     tracep(ps, "json");
     json_value res = parse_element(ps);
@@ -132,302 +333,547 @@ static json_value parse_top(parse_state *ps) {
     return res;
 }
 
-static json_value parse_value(parse_state *ps) {
-    tracep(ps, "value");
-    if (peek(ps, '{'))
-        return mk_object_value(parse_object(ps));
-    else if (peek(ps, '['))
-        return mk_array_value(parse_array(ps));
-    else if (peek(ps, '\"'))
-        return mk_string_value(parse_string(ps));
-    else if (peek_anyof(ps, "0123456789-"))
-        return mk_number_value(parse_number(ps));
-    else if (peek(ps, 't')) {
-        parse_true(ps);
-        return mk_true_value();
-    }
-    else if (peek(ps, 'f')) {
-        parse_false(ps);
-        return mk_false_value();
-    }
-    else if (peek(ps, 'n')) {
-        parse_null(ps);
-        return mk_null_value();
-    }
-    else {
-        error(ps);
-        return mk_null_value();
-    }
+static json_value parse_element(parse_state *ps) {
+    tracep(ps, "element");
+    return parse_nested(ps, ps->depth);
 }
 
-static json_object parse_object(parse_state *ps) {
-    tracep(ps, "object");
-    parse_char(ps, '{');
-    parse_ws(ps);
-    if (consume(ps, '}'))
-        return mk_object();
-    else {
-        json_object object = parse_members(ps);
-        parse_char(ps, '}');
-        return object;
-    }
+// parses the members or elements of a container of the given kind up to the
+// end of input, as if they were enclosed in brackets
+static json_value parse_run(parse_state *ps, int kind) {
+    tracep(ps, "run");
+    int base = ps->depth;
+    open_container(ps, kind, EOF);
+    return parse_nested(ps, base);
 }
 
-static json_object parse_members(parse_state *ps) {
-    tracep(ps, "members");
-    json_object res = mk_object();
-    object_append(&res, parse_member(ps));
-    while (consume(ps, ','))
-        object_append(&res, parse_member(ps));
-    return res;
+// parses values until the container at depth base is complete; containers
+// are kept on an explicit stack rather than parsed recursively, so that the
+// nesting depth is only limited by memory
+static json_value parse_nested(parse_state *ps, int base) {
+    tracep(ps, "nested");
+    json_value res;
+    for (;;) {
+        // at the start of an element, or of a member
+        parse_ws(ps);
+        if (ps->depth > base && ps->stack[ps->depth - 1].kind == OBJECT) {
+            ps->stack[ps->depth - 1].key = parse_key(ps);
+            parse_ws(ps);
+            parse_char(ps, ':');
+            parse_ws(ps);
+        }
+        int kind = peek(ps, '{') ? OBJECT : peek(ps, '[') ? ARRAY : NUL;
+        if (kind != NUL && !(ps->lazy && ps->depth > 0)) {
+            advance(ps);
+            open_container(ps, kind, kind == OBJECT ? '}' : ']');
+            parse_ws(ps);
+            if (!consume(ps, kind == OBJECT ? '}' : ']')) {
+                if (ps->progress && ps->depth == 1)
+                    publish(ps, NULL, 0);
+                continue;
+            }
+            res = close_container(ps);
+        }
+        else {
+            res = parse_scalar(ps);
+        }
+
+        // res is complete: add it to its container, and complete any
+        // containers that end with it
+        for (;;) {
+            parse_ws(ps);
+            if (ps->depth == base)
+                return res;
+            parse_frame *top = &ps->stack[ps->depth - 1];
+            if (top->kind == OBJECT)
+                publish_member(ps, (json_member){ top->key, res });
+            else
+                publish_element(ps, res);
+            if (consume(ps, ',')) {
+                report_progress(ps);
+                break;
+            }
+            parse_char(ps, top->close);
+            res = close_container(ps);
+        }
+    }
 }
 
-static json_member parse_member(parse_state *ps) {
-    tracep(ps, "member");
-    parse_ws(ps);
-    char *key = parse_string(ps);
-    parse_ws(ps);
-    parse_char(ps, ':');
-    json_value val = parse_element(ps);
-    return (json_member){ key, val };
+// the children of a container are collected on top of the scratch stack
+static void open_container(parse_state *ps, int kind, int close) {
+    if (ps->depth == ps->stack_capacity) {
+        ps->stack_capacity = ps->stack_capacity ? 2 * ps->stack_capacity : 16;
+        ps->stack = realloc(ps->stack,
+                            ps->stack_capacity * sizeof(parse_frame));
+    }
+    parse_frame *top = &ps->stack[ps->depth++];
+    top->kind = kind;
+    top->close = close;
+    top->start = ps->scratch.raw_size;
+    top->key = NULL;
 }
 
-static json_array parse_array(parse_state *ps) {
-    tracep(ps, "array");
-    parse_char(ps, '[');
-    parse_ws(ps);
-    if (consume(ps, ']'))
-        return mk_array();
-    else {
-        json_array array = parse_elements(ps);
-        parse_char(ps, ']');
-        return array;
+// moves the children of a frame to the arena, where they take up exactly
+// the space they need; empty containers take up none
+static json_value finish_frame(parse_state *ps, parse_frame *frame) {
+    buffer children = ps->scratch;
+    children.data += frame->start;
+    children.raw_size -= frame->start;
+    if (ps->progress && frame == ps->stack)
+        children = ps->published;
+    else
+        ps->scratch.raw_size = frame->start;
+
+    buffer res = { NULL, children.raw_size, children.raw_size };
+    if (res.raw_size) {
+        res.data = arena_alloc(ps->arena, res.raw_size);
+        memcpy(res.data, children.data, res.raw_size);
     }
+    return frame->kind == OBJECT ? mk_object_value(res) : mk_array_value(res);
 }
 
-static json_array parse_elements(parse_state *ps) {
-    tracep(ps, "elements");
-    json_array res = mk_array();
-    array_append(&res, parse_element(ps));
-    while (consume(ps, ','))
-        array_append(&res, parse_element(ps));
+static json_value close_container(parse_state *ps) {
+    json_value res = finish_frame(ps, &ps->stack[--ps->depth]);
+    // observers must stop referring to the frame before it is reused
+    if (ps->progress && ps->depth == 0) {
+        pthread_mutex_lock(&ps->progress->lock);
+        ps->progress->root = res;
+        pthread_mutex_unlock(&ps->progress->lock);
+    }
     return res;
 }
 
-static json_value parse_element(parse_state *ps) {
-    tracep(ps, "element");
-    parse_ws(ps);
-    json_value res = parse_value(ps);
-    parse_ws(ps);
-    return res;
+static json_value parse_scalar(parse_state *ps) {
+    tracep(ps, "scalar");
+    switch (value_start[(unsigned char)cur(ps)]) {
+        case VS_CONTAINER:
+            return parse_lazy(ps);
+        case VS_STRING:
+            return parse_string(ps);
+        case VS_NUMBER:
+            return parse_number(ps);
+        case VS_TRUE:
+            parse_true(ps);
+            return mk_true_value();
+        case VS_FALSE:
+            parse_false(ps);
+            return mk_false_value();
+        case VS_NULL:
+            parse_null(ps);
+            return mk_null_value();
+        default:
+            error(ps);
+            return mk_null_value();
+    }
 }
 
-static char *parse_string(parse_state *ps) {
+// skips to the end of the container at the current position, recording only
+// its extent and number of children
+static json_value parse_lazy(parse_state *ps) {
+    tracep(ps, "lazy");
+    json_lazy *stub = arena_alloc(ps->arena, sizeof(json_lazy));
+    stub->arena = ps->arena;
+    stub->keys = ps->keys;
+    stub->start = ps->p;
+    stub->input = ps->window;
+    unsigned size = 0;
+    stub->forced = 0;
+    int kind = peek(ps, '{') ? OBJECT : ARRAY;
+
+    if (ps->p < ps->idx.base || ps->p >= ps->idx.end)
+        index_build(&ps->idx, ps->p, ps->end);
+    int depth = 0;
+    for (const char *q = ps->p; ; q++) {
+        q = index_next(&ps->idx, q);
+        if (q == ps->end) {
+            skip_to(ps, q);
+            error(ps);
+        }
+        else if (q == ps->idx.end) {
+            index_continue(&ps->idx, ps->end);
+            q--;
+            continue;
+        }
+        if (depth == 1 && size == 0 && *q != '}' && *q != ']')
+            size = 1;
+        switch (*q) {
+            case '{':
+            case '[':
+                depth++;
+                break;
+            case '}':
+            case ']':
+                depth--;
+                break;
+            case ',':
+                if (depth == 1)
+                    size++;
+                break;
+        }
+        if (depth == 0) {
+            stub->end = q + 1;
+            break;
+        }
+    }
+    skip_to(ps, stub->end);
+    return mk_lazy_value(kind, size, stub);
+}
+
+static json_value parse_string(parse_state *ps) {
     tracep(ps, "string");
     parse_char(ps, '\"');
-    char *res = parse_characters(ps);
+    json_value res = parse_characters(ps);
     parse_char(ps, '\"');
     return res;
 }
 
-static char *parse_characters(parse_state *ps) {
-    tracep(ps, "characters");
-    int str_size = 16;
-    char *res = malloc(str_size * sizeof(char));
-    int i;
-    for (i = 0; !peek(ps, '\"'); i += parse_character(ps, &res[i])) {
-        if (i * 2 >= str_size) {
-            str_size *= 2;
-            res = realloc(res, str_size * sizeof(char));
+// keys without escapes are looked up in place, without being copied first
+static char *parse_key(parse_state *ps) {
+    tracep(ps, "key");
+    parse_char(ps, '\"');
+    const char *q = scan_string(ps->p, ps->end);
+    char *res;
+    if (q < ps->end && *q == '\"') {
+        check_utf8(ps, ps->p, q);
+        res = ps->check ? NULL : intern(ps->keys, ps->p, q - ps->p);
+        skip_to(ps, q);
+    }
+    else {
+        json_value s = parse_characters(ps);
+        if (ps->check)
+            res = NULL;
+        else if (s.escaped) {
+            // decoded past the top of the scratch stack, since intern()
+            // keeps a copy
+            char *decoded = buffer_reserve(&ps->scratch, s.size + 1);
+            res = intern(ps->keys, decoded,
+                         unescape(string_data(&s), s.size, decoded));
         }
+        else
+            res = intern(ps->keys, string_data(&s), s.size);
     }
-    res[i] = '\0';
-    //res = realloc(res, i * sizeof(char) + 1);
+    parse_char(ps, '\"');
     return res;
 }
 
-static int parse_character(parse_state *ps, char *s) {
-    tracep(ps, "character");
-    unsigned char c = (unsigned char)cur(ps);
-    if (c == '\\')
-        return parse_escape(ps, s);
-    else if (c == '\"' || c < 0x20) {
-        error(ps);
-        return 0;
+// strings are kept as they appear in the input, which they refer to in
+// place; their escapes are only checked here, and decoded on demand by
+// unescape()
+static json_value parse_characters(parse_state *ps) {
+    tracep(ps, "characters");
+    const char *q = scan_string(ps->p, ps->end), *first = q;
+    while (q + 1 < ps->end && *q == '\\')
+        q = scan_string(q + 2, ps->end);
+    if (q == ps->end || *q == '\\')
+        return parse_characters_stream(ps);
+
+    // q is the closing quote or an invalid character, which is reported
+    // by the caller
+    const char *start = ps->p;
+    check_utf8(ps, start, q);
+    char escape[6];
+    skip_to(ps, first);
+    while (ps->p < q) {
+        copy_escape(ps, escape);
+        skip_to(ps, scan_string(ps->p, q));
     }
-    else if (c <= 0x7f) {
-        consume(ps, c);
-        *s = c;
-        return 1;
+    // windows refilled from a stream do not outlive the parse; short
+    // strings are copied into the value anyway
+    if ((ps->f || ps->reader) && !ps->check &&
+        q - start > SHORT_STRING_SIZE) {
+        char *s = arena_alloc(ps->arena, q - start);
+        memcpy(s, start, q - start);
+        return mk_string_value(s, q - start, first < q);
     }
-    // UTF-8 support
-    else {
-        int num_read;
-        if (c < 0xe0) {
-            s[0] = c;
-            s[1] = fgetc(ps->f);
-            num_read = 2;
-        }
-        else if (c < 0xf0) {
-            s[0] = c;
-            s[1] = fgetc(ps->f);
-            s[2] = fgetc(ps->f);
-            num_read = 3;
-        }
-        else {
-            s[0] = c;
-            s[1] = fgetc(ps->f);
-            s[2] = fgetc(ps->f);
-            s[3] = fgetc(ps->f);
-            num_read = 4;
+    return mk_string_value(start, q - start, first < q);
+}
+
+// the text of the string is collected on top of the scratch stack, and then
+// copied to the arena unless it is short
+static json_value parse_characters_stream(parse_state *ps) {
+    buffer *res = &ps->scratch;
+    unsigned start = res->raw_size;
+    char escape[6];
+    int escaped = 0;
+    for (;;) {
+        const char *run = scan_string(ps->p, ps->end);
+        int found = run < ps->end;
+        buffer_append(res, ps->p, run - ps->p);
+        // refills the window if the run reaches its end
+        skip_to(ps, run);
+        if (peek(ps, '\\')) {
+            buffer_append(res, escape, copy_escape(ps, escape));
+            escaped = 1;
         }
-        advance(ps);
-        return num_read;
+        else if (found || ps->p == ps->end)
+            break;
     }
+    unsigned len = res->raw_size - start;
+    const char *text = res->data + start;
+    const char *bad = validate_utf8(text, text + len);
+    if (bad < text + len) {
+        // the string ends at the current position; if it started in an
+        // earlier window, an error there is reported at the start of this
+        // one
+        const char *pos = ps->p - (text + len - bad);
+        fail(ps, pos >= ps->window ? pos : ps->window, *bad, ENCODING_ERROR);
+    }
+    res->raw_size = start;
+    if (ps->check || len <= SHORT_STRING_SIZE)
+        return mk_string_value(text, len, escaped);
+    char *s = arena_alloc(ps->arena, len);
+    memcpy(s, res->data + start, len);
+    return mk_string_value(s, len, escaped);
 }
 
 // https://en.wikipedia.org/wiki/UTF-8#Encoding
-static inline int utf8_encode(char *dest, wchar_t src) {
+static inline int utf8_encode(char *dest, uint32_t src) {
     if (src < 0x80) {
         dest[0] = src;
         return 1;
     }
     else if (src < 0x800) {
-        dest[0] = 0b11000000 | (src & 0x0f00) >> 6 | (src & 0x00c0) >> 6;
-        dest[1] = 0b10000000 | (src & 0x0030) | (src & 0x000f);
+        dest[0] = 0b11000000 | src >> 6;
+        dest[1] = 0b10000000 | (src & 0x3f);
         return 2;
     }
     else if (src < 0x10000) {
-        dest[0] = 0b11100000 | (src & 0xf000) >> 12;
-        dest[1] = 0b10000000 | (src & 0x0f00) >> 6 | (src & 0x00c0) >> 6;
-        dest[2] = 0b10000000 | (src & 0x0030) | (src & 0x000f);
+        dest[0] = 0b11100000 | src >> 12;
+        dest[1] = 0b10000000 | (src >> 6 & 0x3f);
+        dest[2] = 0b10000000 | (src & 0x3f);
         return 3;
     }
     else {
-        // we won't encode values larger than \uFFFF
-        assert(0);
+        dest[0] = 0b11110000 | src >> 18;
+        dest[1] = 0b10000000 | (src >> 12 & 0x3f);
+        dest[2] = 0b10000000 | (src >> 6 & 0x3f);
+        dest[3] = 0b10000000 | (src & 0x3f);
+        return 4;
     }
 }
 
-static int parse_escape(parse_state *ps, char *s) {
+// checks the escape at the current position, and copies it as it is to
+// raw; returns its length
+static int copy_escape(parse_state *ps, char *raw) {
     tracep(ps, "escape");
     parse_char(ps, '\\');
-    if (consume(ps, '\"'))
-        *s = '\"';
-    else if (consume(ps, '\\'))
-        *s = '\\';
-    else if (consume(ps, '/'))
-        *s = '/';
-    else if (consume(ps, 'b'))
-        *s = '\b';
-    else if (consume(ps, 'f'))
-        *s = '\f';
-    else if (consume(ps, 'n'))
-        *s = '\n';
-    else if (consume(ps, 'r'))
-        *s = '\r';
-    else if (consume(ps, 't'))
-        *s = '\t';
-    else if (consume(ps, 'u')) {
-        wchar_t wc = parse_hex(ps) << 12 |
-                     parse_hex(ps) << 8  |
-                     parse_hex(ps) << 4  |
-                     parse_hex(ps);
-        return utf8_encode(s, wc);
+    raw[0] = '\\';
+    raw[1] = cur(ps);
+    if (consume(ps, 'u')) {
+        for (int i = 2; i < 6; i++) {
+            raw[i] = cur(ps);
+            parse_hex(ps);
+        }
+        return 6;
     }
-    else {
+    if (!peek_class(ps, CC_ESCAPE))
         error(ps);
+    advance(ps);
+    return 2;
+}
+
+static inline uint32_t hex4(const char *s) {
+    return hex_digit[(unsigned char)s[0]] << 12 |
+           hex_digit[(unsigned char)s[1]] << 8 |
+           hex_digit[(unsigned char)s[2]] << 4 |
+           hex_digit[(unsigned char)s[3]];
+}
+
+// decodes the \u escape at s, which may start a surrogate pair, into *c;
+// returns its length, or 0 if it is cut off at end
+static int unescape_u(const char *s, const char *end, uint32_t *c) {
+    if (end - s < 6)
         return 0;
+    *c = hex4(s + 2);
+    if (*c < 0xd800 || *c >= 0xe000)
+        return 6;
+    if (*c < 0xdc00 && end - s > 6 && s[6] == '\\' &&
+        (end - s == 7 || s[7] == 'u')) {
+        if (end - s < 12)
+            return 0;
+        uint32_t low = hex4(s + 8);
+        if (low >= 0xdc00 && low < 0xe000) {
+            *c = 0x10000 + ((*c - 0xd800) << 10) + (low - 0xdc00);
+            return 12;
+        }
+    }
+    // the halves of a pair cannot be encoded on their own
+    *c = 0xfffd;
+    return 6;
+}
+
+size_t unescape(const char *s, size_t len, char *dest) {
+    const char *end = s + len;
+    char *d = dest;
+    for (;;) {
+        const char *q = memchr(s, '\\', end - s);
+        if (!q)
+            q = end;
+        memcpy(d, s, q - s);
+        d += q - s;
+        s = q;
+        if (end - s < 2)
+            break;
+        if (s[1] == 'u') {
+            uint32_t c;
+            int n = unescape_u(s, end, &c);
+            if (!n)
+                break;
+            d += utf8_encode(d, c);
+            s += n;
+            continue;
+        }
+        switch (s[1]) {
+            case 'b':
+                *d++ = '\b';
+                break;
+            case 'f':
+                *d++ = '\f';
+                break;
+            case 'n':
+                *d++ = '\n';
+                break;
+            case 'r':
+                *d++ = '\r';
+                break;
+            case 't':
+                *d++ = '\t';
+                break;
+            default:
+                *d++ = s[1];
+        }
+        s += 2;
     }
-    return 1;
+    *d = '\0';
+    return d - dest;
 }
 
 static char parse_hex(parse_state *ps) {
     tracep(ps, "hex");
-    char res;
-    if ((res = consume_anyof(ps, "0123456789")))
-        return res - '0';
-    else if ((res = consume_anyof(ps, "ABCDEF")))
-        return 10 + res - 'A';
-    else if ((res = consume_anyof(ps, "abcdef")))
-        return 10 + res - 'a';
-    else {
+    if (!peek_class(ps, CC_HEX))
         error(ps);
-        return 0;
-    }
+    char res = hex_digit[(unsigned char)cur(ps)];
+    advance(ps);
+    return res;
 }
 
-static float parse_number(parse_state *ps) {
+// numbers are converted in a single pass: the first 19 significant digits
+// are accumulated in w, and the value is w * 10^exp
+static json_value parse_number(parse_state *ps) {
     tracep(ps, "number");
-    char s[48];
-    int i = parse_integer(ps);
-    int f = parse_fraction(ps);
-    int e = parse_exponent(ps);
-    snprintf(s, 48, "%d.%de%d", i, f, e);
-    return atof(s);
+    decimal d = { 0 };
+    parse_integer(ps, &d);
+    int integral = !peek_class(ps, CC_FRACTION);
+    parse_fraction(ps, &d);
+    parse_exponent(ps, &d);
+
+    if (integral && d.ndigits <= 19) {
+        if (!d.negative && d.w <= INT64_MAX)
+            return mk_integer_value(d.w);
+        if (d.negative && d.w <= (uint64_t)INT64_MAX + 1)
+            return mk_integer_value(-(int64_t)(d.w - 1) - 1);
+    }
+
+    double x;
+    if (d.ndigits <= 19 && decimal_to_double(d.w, d.exp, d.negative, &x))
+        return mk_number_value(x);
+    // digits beyond the 19th: the value is bracketed by w and w + 1, and
+    // both of them usually round to the same double
+    double y;
+    if (d.ndigits > 19 &&
+        decimal_to_double(d.w, d.exp + d.ndigits - 19, d.negative, &x) &&
+        decimal_to_double(d.w + 1, d.exp + d.ndigits - 19, d.negative, &y) &&
+        x == y)
+        return mk_number_value(x);
+
+    // otherwise, fall back to strtod on the digits that were read
+    if (d.ndigits <= 19)
+        start_digits(ps, &d);
+    string_nprintf(&ps->digits, 0, "e%d", d.exp);
+    x = strtod(ps->digits.data, NULL);
+    return mk_number_value(d.negative ? -x : x);
 }
 
-static int parse_integer(parse_state *ps) {
-    tracep(ps, "integer");
-    int sgn = consume(ps, '-') ? -1 : 1;
-    return sgn * parse_pos_integer(ps);
+static void start_digits(parse_state *ps, decimal *d) {
+    if (!ps->digits.data)
+        ps->digits = mk_string(64);
+    string_clear(&ps->digits);
+    string_nprintf(&ps->digits, 0, "%" PRIu64, d->w);
 }
 
-static int parse_pos_integer(parse_state *ps) {
-    tracep(ps, "pos_integer");
-    if (peek(ps, '0'))
-        return parse_digit(ps);
-    else if (peek_anyof(ps, "123456789"))
-        return parse_digits(ps);
-    else {
+static void parse_integer(parse_state *ps, decimal *d) {
+    tracep(ps, "integer");
+    d->negative = consume(ps, '-');
+    if (consume(ps, '0'))
+        return;
+    else if (peek_class(ps, CC_DIGIT))
+        parse_digits(ps, d, 0);
+    else
         error(ps);
-        return 0;
-    }
 }
 
-static int parse_digits(parse_state *ps) {
+// appends a run of digits to d, counting them as fractional if frac is set
+static void parse_digits(parse_state *ps, decimal *d, int frac) {
     tracep(ps, "digits");
-    int res = parse_digit(ps);
-    while (peek_anyof(ps, "0123456789")) {
-        res *= 10;
-        res += parse_digit(ps);
-    }
-    return res;
-}
-
-static int parse_digit(parse_state *ps) {
-    tracep(ps, "digit");
-    return parse_anyof(ps, "0123456789") - '0';
+    if (!peek_class(ps, CC_DIGIT))
+        error(ps);
+    do {
+        int digit = cur(ps) - '0';
+        if (d->ndigits == 0 && digit == 0) {
+            // leading zeros of a fraction only move the decimal point
+        }
+        else if (d->ndigits < 19) {
+            d->w = d->w * 10 + digit;
+            d->ndigits++;
+        }
+        else {
+            // only kept for the slow path; they do not contribute to w
+            if (d->ndigits == 19)
+                start_digits(ps, d);
+            string_nprintf(&ps->digits, 0, "%c", cur(ps));
+            d->ndigits++;
+        }
+        if (frac)
+            d->exp--;
+        advance(ps);
+    } while (peek_class(ps, CC_DIGIT));
 }
 
-static int parse_fraction(parse_state *ps) {
+static void parse_fraction(parse_state *ps, decimal *d) {
     tracep(ps, "fraction");
     if (consume(ps, '.'))
-        return parse_digits(ps);
-    return 0;
+        parse_digits(ps, d, 1);
 }
 
-static int parse_exponent(parse_state *ps) {
+static void parse_exponent(parse_state *ps, decimal *d) {
     tracep(ps, "exponent");
-    if (consume(ps, 'E') || consume(ps, 'e')) {
-        return parse_sign(ps) * parse_digits(ps);
-    }
-    return 0;
-}
-
-static int parse_sign(parse_state *ps) {
-    tracep(ps, "sign");
-    if (consume(ps, '+'))
-        return 1;
-    else if (consume(ps, '-'))
-        return -1;
+    if (!consume(ps, 'E') && !consume(ps, 'e'))
+        return;
+    int sgn = 1;
+    if (consume(ps, '-'))
+        sgn = -1;
     else
-        return 1;
+        consume(ps, '+');
+    if (!peek_class(ps, CC_DIGIT))
+        error(ps);
+    int e = 0;
+    while (peek_class(ps, CC_DIGIT)) {
+        // anything beyond this is zero or infinity regardless of the digits
+        if (e < 100000)
+            e = e * 10 + cur(ps) - '0';
+        advance(ps);
+    }
+    d->exp += sgn * e;
 }
 
 static void parse_ws(parse_state *ps) {
     tracep(ps, "ws");
-    while (consume_anyof(ps, " \n\r\t"));
+    while (peek_class(ps, CC_WS)) {
+        const char *q = ps->p + 1;
+        while (q < ps->end && char_class[(unsigned char)*q] & CC_WS)
+            q++;
+        skip_to(ps, q);
+    }
 }
 
 static void parse_true(parse_state *ps) {
@@ -455,26 +901,439 @@ static void parse_null(parse_state *ps) {
     parse_char(ps, 'l');
 }
 
-parse_result parse_json(FILE *input) {
-    parse_state ps = { .f = input, .consumed = 0, .line = 1, .col = 0 };
-    advance(&ps);
-    if (setjmp(ps.on_err)) {
+// sets the position of pos in the error of pe, which holds that of window,
+// along with an excerpt of the line around it
+static void locate(parse_result *pe, const char *window, const char *pos,
+                   const char *end) {
+    count_position(window, pos, &pe->error.line, &pe->error.col);
+    const char *from = pos - window > EXCERPT_SIZE / 2 ? pos - EXCERPT_SIZE / 2
+                                                       : window;
+    const char *to = end - from > EXCERPT_SIZE ? from + EXCERPT_SIZE : end;
+    // whole characters of the same line
+    for (const char *q = from; q < pos; q++)
+        if (*q == '\n')
+            from = q + 1;
+    while (from < pos && ((unsigned char)*from & 0xc0) == 0x80)
+        from++;
+    const char *eol = memchr(pos, '\n', to - pos);
+    if (eol)
+        to = eol;
+    while (to > pos && to < end && ((unsigned char)*to & 0xc0) == 0x80)
+        to--;
+
+    char *excerpt = pe->error.excerpt;
+    for (const char *q = from; q < to;) {
+        // invalid UTF-8 is replaced byte by byte
+        const char *bad = validate_utf8(q, to);
+        for (; q < bad; q++) {
+            unsigned char c = *q;
+            *excerpt++ = c == '\t' ? ' ' : c < 0x20 || c == 0x7f ? '?' : c;
+        }
+        if (q < to) {
+            *excerpt++ = '?';
+            q++;
+        }
+    }
+    pe->error.excerpt_len = to - from;
+    pe->error.excerpt_pos = pos - from;
+}
+
+static void begin(parse_state *ps) {
+    if (ps->p < ps->end || refill(ps))
+        ps->tok = (unsigned char)*ps->p;
+    else
+        ps->tok = EOF;
+}
+
+static parse_result parse(parse_state *ps) {
+    begin(ps);
+    if (setjmp(ps->on_err)) {
         parse_result pe;
         pe.success = 0;
-        pe.error.line = ps.line;
-        pe.error.col = ps.col;
-        pe.error.tok = ps.tok;
+        pe.error.line = ps->line;
+        pe.error.col = ps->col;
+        locate(&pe, ps->window, ps->p, ps->end);
+        pe.error.tok = ps->tok;
+        pe.error.kind = ps->error_kind;
+        // observers keep the children published so far
+        if (ps->progress && ps->depth > 0) {
+            json_value partial = finish_frame(ps, &ps->stack[0]);
+            pthread_mutex_lock(&ps->progress->lock);
+            ps->progress->root = partial;
+            pthread_mutex_unlock(&ps->progress->lock);
+        }
         return pe;
     }
-    return (parse_result){ .success = 1, .res = parse_top(&ps) };
+    return (parse_result){ .success = 1, .res = parse_top(ps) };
+}
+
+static void parse_state_free(parse_state *ps) {
+    index_free(&ps->idx);
+    free(ps->stack);
+    buffer_free(&ps->scratch);
+    free(ps->published.data);
+    free(ps->digits.data);
+}
+
+static parse_result parse_indexed(parse_state *ps) {
+    ps->idx = mk_index();
+    ps->scratch = mk_buffer(SCRATCH_SIZE);
+    if (ps->progress)
+        ps->published = mk_buffer(SCRATCH_SIZE);
+    parse_result pr = parse(ps);
+    parse_state_free(ps);
+    return pr;
+}
+
+// parses into a new arena, which is handed to the result unless the parse
+// failed without anyone observing it
+static parse_result parse_document(parse_state *ps) {
+    ps->arena = mk_arena();
+    ps->keys = mk_intern_table(ps->arena);
+    parse_result pr = parse_indexed(ps);
+    if (pr.success || ps->progress)
+        pr.arena = ps->arena;
+    else {
+        arena_free(ps->arena);
+        pr.arena = NULL;
+    }
+    return pr;
+}
+
+parse_result parse_json_buf(const char *data, size_t len) {
+    parse_state ps = { .p = data, .end = data + len, .window = data,
+                       .line = 1, .col = 1 };
+    return parse_document(&ps);
+}
+
+parse_result parse_json_in(const char *data, size_t len, arena *a,
+                           intern_table *keys) {
+    parse_state ps = { .p = data, .end = data + len, .window = data,
+                       .line = 1, .col = 1, .arena = a, .keys = keys };
+    parse_result pr = parse_indexed(&ps);
+    pr.arena = a;
+    return pr;
+}
+
+parse_result parse_json_lazy(const char *data, size_t len) {
+    parse_state ps = { .p = data, .end = data + len, .window = data,
+                       .line = 1, .col = 1, .lazy = 1 };
+    return parse_document(&ps);
+}
+
+static parse_result parse_observed(parse_state *ps) {
+    parse_result pr = parse_document(ps);
+    parse_progress *progress = ps->progress;
+    if (progress) {
+        // not report_progress(), which raises the error of a cancelled
+        // parse: there is nothing left to jump back to
+        __atomic_store_n(&progress->consumed,
+                         ps->window_offset + (ps->p - ps->window),
+                         __ATOMIC_RELAXED);
+        pthread_mutex_lock(&progress->lock);
+        if (pr.success)
+            progress->root = pr.res;
+        progress->done = 1;
+        pthread_mutex_unlock(&progress->lock);
+        if (progress->notify)
+            progress->notify();
+    }
+    return pr;
+}
+
+parse_result parse_json_progress(const char *data, size_t len, reader *input,
+                                 parse_progress *progress) {
+    parse_state ps = { .p = data, .end = data + len, .window = data,
+                       .line = 1, .col = 1, .progress = progress };
+    if (!data) {
+        ps.reader = input;
+        ps.p = ps.end = ps.window = NULL;
+    }
+    return parse_observed(&ps);
+}
+
+parse_result parse_json(FILE *input) {
+    char *chunk = malloc(CHUNK_SIZE);
+    parse_state ps = { .p = chunk, .end = chunk, .window = chunk,
+                       .line = 1, .col = 1, .f = input, .chunk = chunk };
+    parse_result pr = parse_observed(&ps);
+    free(chunk);
+    return pr;
+}
+
+parse_result check_json(const char *data, size_t len, reader *input,
+                        size_t *consumed) {
+    parse_state ps = { .p = data, .end = data + len, .window = data,
+                       .line = 1, .col = 1, .check = 1 };
+    if (!data) {
+        ps.reader = input;
+        ps.p = ps.end = ps.window = NULL;
+    }
+    parse_result pr = parse_document(&ps);
+    if (consumed)
+        *consumed = ps.window_offset + (ps.p - ps.window);
+    if (pr.arena)
+        arena_free(pr.arena);
+    pr.arena = NULL;
+    return pr;
+}
+
+parse_result check_json_lines(const char *data, size_t len, int first_line) {
+    parse_state ps = { .check = 1 };
+    ps.arena = mk_arena();
+    ps.keys = mk_intern_table(ps.arena);
+    ps.idx = mk_index();
+    ps.scratch = mk_buffer(SCRATCH_SIZE);
+    parse_result pr = { .success = 1 };
+    const char *end = data + len;
+    for (const char *p = data; p < end && pr.success; first_line++) {
+        const char *eol = memchr(p, '\n', end - p);
+        if (!eol)
+            eol = end;
+        const char *q = p;
+        while (q < eol && char_class[(unsigned char)*q] & CC_WS)
+            q++;
+        if (q < eol) {
+            ps.p = ps.window = p;
+            ps.end = eol;
+            ps.line = first_line;
+            ps.col = 1;
+            ps.depth = 0;
+            ps.idx.base = ps.idx.end = NULL;
+            pr = parse(&ps);
+        }
+        p = eol + 1;
+    }
+    parse_state_free(&ps);
+    arena_free(ps.arena);
+    pr.arena = NULL;
+    return pr;
+}
+
+// a run of consecutive elements or members of the top-level container
+typedef struct {
+    const char *start, *end;
+    int kind;
+    pthread_t thread;
+    // whether thread was started, or the job run by the caller instead
+    int threaded;
+    int success;
+    json_value res;
+    arena *arena;
+    // where and why parsing failed, if it did
+    const char *err;
+    int error_kind;
+} parse_job;
+
+static void *parse_job_run(void *arg) {
+    parse_job *job = arg;
+    parse_state ps = { .p = job->start, .end = job->end,
+                       .window = job->start, .line = 1, .col = 1,
+                       .arena = job->arena,
+                       .keys = mk_intern_table(job->arena) };
+    ps.idx = mk_index();
+    ps.scratch = mk_buffer(SCRATCH_SIZE);
+    begin(&ps);
+    if (setjmp(ps.on_err)) {
+        job->success = 0;
+        job->err = ps.p;
+        job->error_kind = ps.error_kind;
+    }
+    else {
+        job->res = parse_run(&ps, job->kind);
+        job->success = 1;
+    }
+    parse_state_free(&ps);
+    return NULL;
+}
+
+// splits the top-level container at commas between its children into at
+// most max_jobs runs of similar size; returns the number of runs, or 0 if
+// the input is not a single non-empty container
+static int split_jobs(const char *data, size_t len, parse_job *jobs,
+                      int max_jobs) {
+    const char *end = data + len;
+    struct_index idx = mk_index();
+    index_build(&idx, data, end);
+    const char *open = index_next(&idx, data);
+    if (open == end || (*open != '[' && *open != '{')) {
+        index_free(&idx);
+        return 0;
+    }
+    int kind = *open == '{' ? OBJECT : ARRAY;
+
+    int num_jobs = 0;
+    const char *start = open + 1;
+    int depth = 0;
+    for (const char *q = open; ; q++) {
+        q = index_next(&idx, q);
+        if (q == end)
+            break;
+        else if (q == idx.end) {
+            index_continue(&idx, end);
+            q--;
+            continue;
+        }
+        switch (*q) {
+            case '{':
+            case '[':
+                depth++;
+                break;
+            case '}':
+            case ']':
+                depth--;
+                break;
+            case ',':
+                // cut once this run has reached its share of the input
+                if (depth == 1 && num_jobs < max_jobs - 1 &&
+                    q - data >= len / max_jobs * (num_jobs + 1)) {
+                    jobs[num_jobs++] = (parse_job){ start, q, kind };
+                    start = q + 1;
+                }
+                break;
+        }
+        if (depth == 0) {
+            // a mismatched closer is left for the serial parse to report
+            if (*q != (kind == OBJECT ? '}' : ']'))
+                break;
+            jobs[num_jobs++] = (parse_job){ start, q, kind };
+            // only whitespace may follow
+            for (q++; q < end && num_jobs > 0; q++)
+                if (!(char_class[(unsigned char)*q] & CC_WS))
+                    num_jobs = 0;
+            index_free(&idx);
+            return num_jobs;
+        }
+    }
+    index_free(&idx);
+    return 0;
+}
+
+parse_result parse_json_parallel(const char *data, size_t len, int max_jobs) {
+    parse_job *jobs = malloc(max_jobs * sizeof(parse_job));
+    int num_jobs = max_jobs > 1 ? split_jobs(data, len, jobs, max_jobs) : 0;
+    // an empty container only has a single run, which would fail to parse
+    if (num_jobs == 1) {
+        const char *q = jobs[0].start;
+        while (q < jobs[0].end && strchr(" \n\r\t", *q))
+            q++;
+        if (q == jobs[0].end)
+            num_jobs = 0;
+    }
+    if (num_jobs == 0) {
+        free(jobs);
+        return parse_json_buf(data, len);
+    }
+
+    // a job that cannot get a thread of its own is run by this one
+    for (int i = 0; i < num_jobs; i++) {
+        jobs[i].arena = mk_arena();
+        jobs[i].threaded = pthread_create(&jobs[i].thread, NULL,
+                                          parse_job_run, &jobs[i]) == 0;
+        if (!jobs[i].threaded)
+            parse_job_run(&jobs[i]);
+    }
+    for (int i = 0; i < num_jobs; i++)
+        if (jobs[i].threaded)
+            pthread_join(jobs[i].thread, NULL);
+
+    parse_result pr = { .success = 1 };
+    unsigned width = jobs[0].kind == OBJECT ? sizeof(json_member)
+                                            : sizeof(json_value);
+    unsigned size = 0;
+    for (int i = 0; i < num_jobs; i++) {
+        if (!jobs[i].success && pr.success) {
+            pr.success = 0;
+            pr.error.line = pr.error.col = 1;
+            locate(&pr, data, jobs[i].err, data + len);
+            pr.error.tok = jobs[i].err < data + len
+                               ? (unsigned char)*jobs[i].err : EOF;
+            pr.error.kind = jobs[i].error_kind;
+        }
+        else if (jobs[i].success)
+            size += jobs[i].res.size * width;
+    }
+    if (!pr.success) {
+        for (int i = 0; i < num_jobs; i++)
+            arena_free(jobs[i].arena);
+        free(jobs);
+        return pr;
+    }
+
+    // stitch the runs together into the top-level container
+    pr.arena = mk_arena();
+    buffer res = { arena_alloc(pr.arena, size), 0, size };
+    for (int i = 0; i < num_jobs; i++) {
+        memcpy(res.data + res.raw_size, jobs[i].res.elements,
+               jobs[i].res.size * width);
+        res.raw_size += jobs[i].res.size * width;
+        arena_merge(pr.arena, jobs[i].arena);
+    }
+    pr.res = jobs[0].kind == OBJECT ? mk_object_value(res)
+                                    : mk_array_value(res);
+    free(jobs);
+    return pr;
+}
+
+void (*on_lazy_error)(parse_result);
+
+json_value value_force(json_value value) {
+    if (!value.lazy)
+        return value;
+    if (value.lazy == LAZY_RECORD)
+        return record_force(value);
+    json_lazy *stub = value.stub;
+    if (!stub->forced) {
+        // anything allocated by a failed parse stays in the arena until
+        // the whole document is freed
+        parse_state ps = { .p = stub->start, .end = stub->end,
+                           .window = stub->input, .line = 1, .col = 1,
+                           .lazy = 1, .arena = stub->arena,
+                           .keys = stub->keys };
+        parse_result pr = parse_indexed(&ps);
+        if (!pr.success) {
+            if (on_lazy_error)
+                on_lazy_error(pr);
+            buffer empty = { NULL, 0, 0 };
+            pr.res = value.kind == OBJECT ? mk_object_value(empty)
+                                          : mk_array_value(empty);
+        }
+        stub->value = pr.res;
+        stub->forced = 1;
+    }
+    return stub->value;
 }
 
 void print_error(FILE *os, parse_result pe) {
-    if (pe.error.tok == '\n')
-        fprintf(stderr, "Error on line %d: unexpected end of line\n", 
-                        pe.error.line);
+    if (pe.error.kind == BINARY_ERROR && pe.error.tok == EOF)
+        fprintf(os, "Error at byte %zu: unexpected end of input\n",
+                    pe.error.offset);
+    else if (pe.error.kind == BINARY_ERROR)
+        fprintf(os, "Error at byte %zu: unexpected byte 0x%02x\n",
+                    pe.error.offset, (unsigned char)pe.error.tok);
+    else if (pe.error.kind == ENCODING_ERROR)
+        fprintf(os, "Error on line %d, column %d: invalid UTF-8 byte 0x%02x\n",
+                    pe.error.line, pe.error.col,
+                    (unsigned char)pe.error.tok);
+    else if (pe.error.tok == EOF)
+        fprintf(os, "Error on line %d: unexpected end of input\n",
+                    pe.error.line);
+    else if (pe.error.tok == '\n')
+        fprintf(os, "Error on line %d: unexpected end of line\n",
+                    pe.error.line);
+    else if (pe.error.tok >= 0x80)
+        fprintf(os, "Error on line %d, column %d: unexpected byte 0x%02x\n",
+                    pe.error.line, pe.error.col, pe.error.tok);
     else
-        fprintf(stderr, "Error on line %d, column %d: "
-                        "unexpected character %c\n", 
-                        pe.error.line, pe.error.col, pe.error.tok);
+        fprintf(os, "Error on line %d, column %d: "
+                    "unexpected character %c\n",
+                    pe.error.line, pe.error.col, pe.error.tok);
+    if (pe.error.kind == BINARY_ERROR || pe.error.excerpt_len == 0)
+        return;
+    // the excerpt, with a caret under where parsing failed
+    fprintf(os, "    %.*s\n    ", pe.error.excerpt_len, pe.error.excerpt);
+    for (int i = 0; i < pe.error.excerpt_pos; i++)
+        if (((unsigned char)pe.error.excerpt[i] & 0xc0) != 0x80)
+            fputc(' ', os);
+    fprintf(os, "^\n");
 }
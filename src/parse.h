@@ -1,7 +1,22 @@
 #pragma once
 
 #include <stdio.h>
+#include <pthread.h>
 #include "json.h"
+#include "reader.h"
+
+#define EXCERPT_SIZE 40
+
+// why parsing failed
+enum {
+    // an unexpected character, or the unexpected end of input
+    SYNTAX_ERROR,
+    // a byte that is not part of a valid UTF-8 sequence
+    ENCODING_ERROR,
+    // malformed binary input, see parse_binary(); only offset and tok are
+    // set
+    BINARY_ERROR
+};
 
 typedef struct {
     int success;
@@ -9,10 +24,76 @@ typedef struct {
         json_value res;
         struct {
             int line, col;
-            char tok;
+            // the offending byte, as an unsigned char, or EOF
+            int tok;
+            int kind;
+            // the input around where parsing failed, within its line, and
+            // the offset of that position in it
+            char excerpt[EXCERPT_SIZE];
+            unsigned char excerpt_len, excerpt_pos;
+            // the offset of tok in binary input
+            size_t offset;
         } error;
     };
+    // all memory of res, released at once by arena_free(); after a failed
+    // parse that was being observed, it still holds the children published
+    // so far
+    arena *arena;
 } parse_result;
 
+// shared with observers of a parse running on another thread: the top-level
+// container grows as each of its children is completed
+typedef struct {
+    pthread_mutex_t lock;
+    // the children of the top-level container parsed so far (or the whole
+    // result once done); only accessed while holding lock
+    json_value root;
+    int done;
+    // bytes parsed so far; read and written atomically
+    size_t consumed;
+    // set atomically by an observer to abandon the parse
+    int cancel;
+    // called whenever root or consumed has changed
+    void (*notify)();
+} parse_progress;
+
+// parses len bytes starting at data, e.g. a memory-mapped file; the strings
+// of the result refer to data, which must outlive it
+parse_result parse_json_buf(const char *data, size_t len);
+// like parse_json_buf, but nested containers are only skipped over and
+// parsed on demand by value_force()
+parse_result parse_json_lazy(const char *data, size_t len);
+// like parse_json_buf, but the children of a top-level array or object are
+// split into up to max_jobs runs that are parsed on separate threads
+parse_result parse_json_parallel(const char *data, size_t len, int max_jobs);
+// like parse_json_buf, but allocates from a and interns keys into keys;
+// whatever has been allocated is kept even if parsing fails
+parse_result parse_json_in(const char *data, size_t len, arena *a,
+                           intern_table *keys);
+// reads and parses f incrementally; for inputs that cannot be mapped
 parse_result parse_json(FILE *f);
+// parses data (or the blocks of input, if data is NULL) while reporting to
+// progress, if not NULL
+parse_result parse_json_progress(const char *data, size_t len, reader *input,
+                                 parse_progress *progress);
+// only validates data (or the blocks of input, if data is NULL), in memory
+// that depends on nesting depth but not on the size of the input; the
+// number of bytes read is stored in consumed, if not NULL
+parse_result check_json(const char *data, size_t len, reader *input,
+                        size_t *consumed);
+// validates each line of data that is not blank as a document of its own,
+// as in newline-delimited JSON; lines are numbered from first_line
+parse_result check_json_lines(const char *data, size_t len, int first_line);
 void print_error(FILE *os, parse_result);
+
+// decodes the escapes in the first len bytes of the text of a string (see
+// json_value) into dest, which needs room for len + 1 bytes; an escape that
+// is cut off at len is left out, and unpaired surrogates become U+FFFD;
+// returns the length of the result, which is NUL-terminated
+size_t unescape(const char *s, size_t len, char *dest);
+
+// returns the parsed contents of a lazily parsed container (parsing them on
+// first use), or value itself for any other value
+json_value value_force(json_value value);
+// called when value_force() fails; the container is then left empty
+extern void (*on_lazy_error)(parse_result);
@@ -1,5 +1,9 @@
 #include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
 #include "json.h"
+#include "parse.h"
+#include "number.h"
 #include "print.h"
 
 static void print_indent(int count) {
@@ -9,14 +13,15 @@ static void print_indent(int count) {
 
 static void print_top(json_value);
 static void print_value(json_value, int);
-static void print_object(json_object, int);
-static void print_members(json_object, int);
+static void print_object(json_value, int);
+static void print_members(json_value, int);
 static void print_member(json_member, int);
-static void print_array(json_array, int);
-static void print_elements(json_array, int);
+static void print_array(json_value, int);
+static void print_elements(json_value, int);
 static void print_element(json_value, int);
-static void print_string(char *);
-static void print_number(float);
+static void print_string(const char *, size_t);
+static void print_number(double);
+static void print_integer(int64_t);
 static void print_true();
 static void print_false();
 static void print_null();
@@ -27,19 +32,23 @@ static void print_top(json_value value) {
 }
 
 static void print_value(json_value value, int indent) {
+    value = value_force(value);
     switch (value.kind) {
         case OBJECT:
-            print_object(value.object, indent);
+            print_object(value, indent);
             break;
         case ARRAY:
-            print_array(value.array, indent);
+            print_array(value, indent);
             break;
         case STRING:
-            print_string(value.string);
+            print_string(string_data(&value), value.size);
             break;
         case NUMBER:
             print_number(value.number);
             break;
+        case INTEGER:
+            print_integer(value.integer);
+            break;
         case TRUE:
             print_true();
             break;
@@ -51,7 +60,7 @@ static void print_value(json_value value, int indent) {
     }    
 }
 
-static void print_object(json_object object, int indent) {
+static void print_object(json_value object, int indent) {
     putchar('{'); 
     if (object_size(object) > 0) {
         putchar('\n');
@@ -61,7 +70,7 @@ static void print_object(json_object object, int indent) {
     putchar('}');
 }
 
-static void print_members(json_object object, int indent) {
+static void print_members(json_value object, int indent) {
     for (int i = 0; i < object_size(object); i++) {
         print_member(object_get(object, i), indent);
         if (i < object_size(object) - 1)
@@ -72,12 +81,12 @@ static void print_members(json_object object, int indent) {
 
 static void print_member(json_member member, int indent) {
     print_indent(indent);
-    print_string(member.key);
+    print_string(member.key, strlen(member.key));
     printf(": ");
     print_value(member.val, indent);
 }
 
-static void print_array(json_array array, int indent) {
+static void print_array(json_value array, int indent) {
     putchar('['); 
     if (array_size(array) > 0) {
         putchar('\n');
@@ -87,7 +96,7 @@ static void print_array(json_array array, int indent) {
     putchar(']');
 }
 
-static void print_elements(json_array array, int indent) {
+static void print_elements(json_value array, int indent) {
     for (int i = 0; i < array_size(array); i++) {
         print_element(array_get(array, i), indent);
         if (i < array_size(array) - 1)
@@ -101,14 +110,21 @@ static void print_element(json_value value, int indent) {
     print_value(value, indent);
 }
 
-static void print_string(char *s) {
+// strings are printed as they appear in the input, escapes included
+static void print_string(const char *s, size_t len) {
     putchar('\"');
-    printf("%s", s);
+    fwrite(s, 1, len, stdout);
     putchar('\"');
 }
 
-static void print_number(float x) {
-    printf("%.2f", x);
+static void print_number(double x) {
+    char s[32];
+    format_number(s, sizeof(s), x);
+    printf("%s", s);
+}
+
+static void print_integer(int64_t x) {
+    printf("%" PRId64, x);
 }
 
 static void print_true() {
@@ -0,0 +1,199 @@
+// for F_SETPIPE_SZ
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "reader.h"
+
+#define BLOCK_SIZE (1 << 20)
+#define NUM_BLOCKS 4
+// fewer wakeups of the reader for pipes
+#define PIPE_SIZE (1 << 20)
+
+typedef struct {
+    char *data;
+    size_t size;
+} block;
+
+// the blocks form a ring: the reader fills them in turn, and the consumer
+// takes them in the same order
+struct reader {
+    // for a mapped file, the blocks are its consecutive slices, handed out
+    // without a thread; see reader_map()
+    const char *map;
+    size_t map_size, map_taken;
+    int fd;
+    // written to by reader_finish() to stop the reader
+    int stop[2];
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t filled, emptied;
+    block blocks[NUM_BLOCKS];
+    // the number of blocks filled, taken and given back by the consumer so
+    // far; only accessed while holding lock
+    size_t num_filled, num_taken, num_released;
+    int done, failed;
+};
+
+// waits until fd is readable; returns 0 once stopped
+static int wait_readable(reader *r, int timeout) {
+    struct pollfd fds[2] = {
+        { .fd = r->fd, .events = POLLIN },
+        { .fd = r->stop[0], .events = POLLIN }
+    };
+    while (poll(fds, 2, timeout) < 0)
+        if (errno != EINTR)
+            return 0;
+    return !(fds[1].revents & POLLIN) && fds[0].revents;
+}
+
+// fills b for as long as input is available right away, so that a slow
+// writer does not hold up the blocks it has already written; returns -1 on
+// failure and 0 once stopped or at the end of input
+static int fill_block(reader *r, block *b) {
+    b->size = 0;
+    if (!wait_readable(r, -1))
+        return 0;
+    do {
+        ssize_t n = read(r->fd, b->data + b->size, BLOCK_SIZE - b->size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return n;
+        b->size += n;
+    } while (b->size < BLOCK_SIZE && wait_readable(r, 0));
+    return 1;
+}
+
+static void *reader_run(void *arg) {
+    reader *r = arg;
+    for (int i = 0;; i = (i + 1) % NUM_BLOCKS) {
+        pthread_mutex_lock(&r->lock);
+        while (r->num_filled - r->num_released == NUM_BLOCKS)
+            pthread_cond_wait(&r->emptied, &r->lock);
+        pthread_mutex_unlock(&r->lock);
+
+        // the consumer has given the block back
+        int ret = fill_block(r, &r->blocks[i]);
+
+        pthread_mutex_lock(&r->lock);
+        if (r->blocks[i].size > 0)
+            r->num_filled++;
+        if (ret <= 0) {
+            r->done = 1;
+            r->failed = ret < 0;
+        }
+        pthread_cond_signal(&r->filled);
+        pthread_mutex_unlock(&r->lock);
+        if (ret <= 0)
+            return NULL;
+    }
+}
+
+reader *reader_start(int fd) {
+    reader *r = calloc(1, sizeof(reader));
+    r->fd = fd;
+    if (pipe(r->stop) < 0) {
+        free(r);
+        return NULL;
+    }
+    fcntl(fd, F_SETPIPE_SZ, PIPE_SIZE);
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->filled, NULL);
+    pthread_cond_init(&r->emptied, NULL);
+    for (int i = 0; i < NUM_BLOCKS; i++)
+        r->blocks[i].data = malloc(BLOCK_SIZE);
+    pthread_create(&r->thread, NULL, reader_run, r);
+    return r;
+}
+
+reader *reader_map(const char *data, size_t size) {
+    reader *r = calloc(1, sizeof(reader));
+    r->map = data;
+    r->map_size = size;
+    madvise((void *)data, size, MADV_SEQUENTIAL);
+    return r;
+}
+
+// the slice of a mapped file that follows the one taken last
+static size_t map_block(reader *r, const char **data) {
+    size_t size = r->map_size - r->map_taken;
+    *data = size ? r->map + r->map_taken : NULL;
+    return size < BLOCK_SIZE ? size : BLOCK_SIZE;
+}
+
+size_t reader_next(reader *r, const char **data) {
+    if (r->map) {
+        // the pages of the previous slice are dropped; they are read from
+        // the file again if they are still needed after all
+        size_t prev = r->map_taken >= BLOCK_SIZE ? r->map_taken - BLOCK_SIZE
+                                                 : 0;
+        madvise((void *)(r->map + prev), r->map_taken - prev, MADV_DONTNEED);
+        size_t size = map_block(r, data);
+        r->map_taken += size;
+        return size;
+    }
+    pthread_mutex_lock(&r->lock);
+    // the block taken last time can be filled again
+    if (r->num_released < r->num_taken) {
+        r->num_released++;
+        pthread_cond_signal(&r->emptied);
+    }
+    while (r->num_taken == r->num_filled && !r->done)
+        pthread_cond_wait(&r->filled, &r->lock);
+    size_t size = 0;
+    *data = NULL;
+    if (r->num_taken < r->num_filled) {
+        block *b = &r->blocks[r->num_taken % NUM_BLOCKS];
+        *data = b->data;
+        size = b->size;
+        r->num_taken++;
+    }
+    pthread_mutex_unlock(&r->lock);
+    return size;
+}
+
+size_t reader_peek(reader *r, const char **data) {
+    if (r->map)
+        return map_block(r, data);
+    pthread_mutex_lock(&r->lock);
+    while (r->num_taken == r->num_filled && !r->done)
+        pthread_cond_wait(&r->filled, &r->lock);
+    size_t size = 0;
+    *data = NULL;
+    if (r->num_taken < r->num_filled) {
+        block *b = &r->blocks[r->num_taken % NUM_BLOCKS];
+        *data = b->data;
+        size = b->size;
+    }
+    pthread_mutex_unlock(&r->lock);
+    return size;
+}
+
+int reader_finish(reader *r) {
+    if (r->map) {
+        free(r);
+        return 1;
+    }
+    write(r->stop[1], "", 1);
+    pthread_mutex_lock(&r->lock);
+    // unblocks a reader waiting for an empty block
+    r->num_released = r->num_filled;
+    pthread_cond_signal(&r->emptied);
+    pthread_mutex_unlock(&r->lock);
+    pthread_join(r->thread, NULL);
+    int ok = !r->failed;
+    close(r->stop[0]);
+    close(r->stop[1]);
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->filled);
+    pthread_cond_destroy(&r->emptied);
+    for (int i = 0; i < NUM_BLOCKS; i++)
+        free(r->blocks[i].data);
+    free(r);
+    return ok;
+}
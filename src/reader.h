@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stddef.h>
+
+typedef struct reader reader;
+
+// starts reading the file fd (typically a pipe) on a separate thread, into
+// large blocks that are handed to the consumer as they fill up, so that
+// reading overlaps with parsing; fd stays owned by the caller
+reader *reader_start(int fd);
+
+// hands out the size bytes of the mapped file at data in blocks, like
+// reader_start() would read them, dropping the pages of each block once the
+// next one is taken, so that walking even a huge file keeps few of them
+// resident; the mapping stays owned by the caller
+reader *reader_map(const char *data, size_t size);
+
+// points data to the next block of input and returns its size, releasing
+// the previous block; returns 0 at the end of input
+size_t reader_next(reader *r, const char **data);
+
+// points data to the next block of input without taking it, so that the
+// following call of reader_next() returns the same block; returns 0 at the
+// end of input
+size_t reader_peek(reader *r, const char **data);
+
+// stops reading and releases r; returns 0 if reading failed
+int reader_finish(reader *r);
@@ -0,0 +1,325 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "snapshot.h"
+
+#define MAGIC "JINSPSN4"
+#define NUM_SAMPLES 64
+#define SAMPLE_SIZE 4096
+
+// the start of a snapshot, which is followed by the path of the input file
+// and then by the children of root and their descendants, breadth first;
+// containers are relative (see resolve_child()), so that a snapshot can be
+// mapped anywhere without being modified, and root refers to what it
+// contains by offsets from the start of the snapshot
+typedef struct {
+    char magic[8];
+    // of the whole snapshot
+    uint64_t size;
+    uint64_t source_size;
+    int64_t mtime_sec, mtime_nsec;
+    uint64_t hash;
+    uint32_t path_len, value_size;
+    json_value root;
+} snapshot_header;
+
+// FNV-1a
+static uint64_t hash_bytes(uint64_t h, const char *s, size_t len) {
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char)s[i]) * 1099511628211u;
+    return h;
+}
+
+// hashes the len bytes of fd at offset, as far as they can be read
+static uint64_t hash_sample(uint64_t h, int fd, uint64_t offset, size_t len) {
+    char sample[SAMPLE_SIZE];
+    ssize_t n = pread(fd, sample, len, offset);
+    return hash_bytes(h, sample, n > 0 ? n : 0);
+}
+
+int mk_snapshot_key(snapshot_key *key, const char *filename,
+                    const struct stat *st, int fd) {
+    key->path = realpath(filename, NULL);
+    if (!key->path)
+        return 0;
+    key->size = st->st_size;
+    key->mtime_sec = st->st_mtim.tv_sec;
+    key->mtime_nsec = st->st_mtim.tv_nsec;
+    // the samples include the first and last bytes of the file
+    uint64_t h = 14695981039346656037u;
+    if (key->size <= NUM_SAMPLES * SAMPLE_SIZE) {
+        for (uint64_t offset = 0; offset < key->size; offset += SAMPLE_SIZE)
+            h = hash_sample(h, fd, offset, key->size - offset < SAMPLE_SIZE
+                                               ? key->size - offset
+                                               : SAMPLE_SIZE);
+    }
+    else {
+        for (int i = 0; i < NUM_SAMPLES; i++) {
+            uint64_t offset = (key->size - SAMPLE_SIZE) / (NUM_SAMPLES - 1) * i;
+            if (i == NUM_SAMPLES - 1)
+                offset = key->size - SAMPLE_SIZE;
+            h = hash_sample(h, fd, offset, SAMPLE_SIZE);
+        }
+    }
+    key->hash = h;
+    return 1;
+}
+
+void snapshot_key_free(snapshot_key *key) {
+    free(key->path);
+    key->path = NULL;
+}
+
+char *snapshot_cache_path(const snapshot_key *key) {
+    const char *cache = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+    char dir[PATH_MAX];
+    if (cache && *cache)
+        snprintf(dir, sizeof(dir), "%s", cache);
+    else if (home && *home)
+        snprintf(dir, sizeof(dir), "%s/.cache", home);
+    else
+        return NULL;
+    mkdir(dir, 0700);
+    strncat(dir, "/jinsp", sizeof(dir) - strlen(dir) - 1);
+    if (mkdir(dir, 0700) < 0 && access(dir, W_OK) < 0)
+        return NULL;
+
+    uint64_t h = hash_bytes(14695981039346656037u, key->path,
+                            strlen(key->path));
+    size_t len = strlen(dir) + 32;
+    char *path = malloc(len);
+    snprintf(path, len, "%s/%016" PRIx64 ".snap", dir, h);
+    return path;
+}
+
+// the offset that a key has been given in the snapshot
+typedef struct {
+    const char *key;
+    uint64_t offset;
+} key_slot;
+
+typedef struct {
+    FILE *f;
+    // the number of bytes that have been given a place so far, and written
+    uint64_t size, written;
+    // containers and strings that have been given a place but not yet been
+    // written, in the order of their places
+    json_value *queue;
+    size_t head, tail, capacity;
+    // keys are interned, so each of them is only written once
+    key_slot *keys;
+    size_t num_keys, keys_capacity;
+} writer;
+
+static uint64_t reserve(writer *w, uint64_t size) {
+    uint64_t offset = w->size;
+    w->size += (size + 7) & ~(uint64_t)7;
+    return offset;
+}
+
+static void enqueue(writer *w, json_value value) {
+    if (w->tail == w->capacity) {
+        if (w->head > w->capacity / 2) {
+            memmove(w->queue, w->queue + w->head,
+                    (w->tail - w->head) * sizeof(json_value));
+            w->tail -= w->head;
+            w->head = 0;
+        }
+        else {
+            w->capacity = w->capacity ? 2 * w->capacity : 1024;
+            w->queue = realloc(w->queue, w->capacity * sizeof(json_value));
+        }
+    }
+    w->queue[w->tail++] = value;
+}
+
+// returns value as it is stored at offset slot in the snapshot, giving a
+// place to its children or text
+static json_value translate(writer *w, json_value value, uint64_t slot) {
+    switch (value.kind) {
+        case OBJECT:
+        case ARRAY: {
+            value.relative = 1;
+            if (value.size == 0) {
+                value.elements = NULL;
+                break;
+            }
+            enqueue(w, value);
+            unsigned width = value.kind == OBJECT ? sizeof(json_member)
+                                                  : sizeof(json_value);
+            value.elements = (json_value *)(intptr_t)
+                (reserve(w, (uint64_t)value.size * width) - slot);
+            break;
+        }
+        case STRING:
+            // short strings are part of the value
+            if (value.embedded)
+                break;
+            enqueue(w, value);
+            value.string = (char *)(intptr_t)(reserve(w, value.size) - slot);
+            break;
+    }
+    return value;
+}
+
+static key_slot *find_key(key_slot *keys, size_t capacity, const char *key) {
+    size_t i = ((uintptr_t)key >> 3) * 0x9e3779b97f4a7c15u & (capacity - 1);
+    while (keys[i].key && keys[i].key != key)
+        i = (i + 1) & (capacity - 1);
+    return &keys[i];
+}
+
+// returns key as it is stored at offset key_offset in the snapshot
+static char *translate_key(writer *w, char *key, uint64_t key_offset) {
+    if (2 * (w->num_keys + 1) > w->keys_capacity) {
+        size_t capacity = w->keys_capacity ? 2 * w->keys_capacity : 256;
+        key_slot *keys = calloc(capacity, sizeof(key_slot));
+        for (size_t i = 0; i < w->keys_capacity; i++)
+            if (w->keys[i].key)
+                *find_key(keys, capacity, w->keys[i].key) = w->keys[i];
+        free(w->keys);
+        w->keys = keys;
+        w->keys_capacity = capacity;
+    }
+    key_slot *slot = find_key(w->keys, w->keys_capacity, key);
+    if (!slot->key) {
+        slot->key = key;
+        json_value text = { .kind = STRING, .size = strlen(key) + 1,
+                            .string = key };
+        slot->offset = (intptr_t)translate(w, text, 0).string;
+        w->num_keys++;
+    }
+    return (char *)(intptr_t)(slot->offset - key_offset);
+}
+
+// writes the children or text of the next value in the queue
+static void write_next(writer *w) {
+    static const char padding[8];
+    json_value value = w->queue[w->head++];
+    switch (value.kind) {
+        case STRING: {
+            // keys are written along with their NUL, see translate_key()
+            size_t len = value.size;
+            fwrite(value.string, 1, len, w->f);
+            fwrite(padding, 1, -len & 7, w->f);
+            w->written += (len + 7) & ~(size_t)7;
+            break;
+        }
+        case OBJECT:
+            for (unsigned i = 0; i < value.size; i++) {
+                json_member memb = value.members[i];
+                memb.key = translate_key(w, memb.key, w->written +
+                                         offsetof(json_member, key));
+                memb.val = translate(w, memb.val, w->written +
+                                     offsetof(json_member, val));
+                fwrite(&memb, sizeof(json_member), 1, w->f);
+                w->written += sizeof(json_member);
+            }
+            break;
+        case ARRAY:
+            for (unsigned i = 0; i < value.size; i++) {
+                json_value elem = translate(w, value.elements[i], w->written);
+                fwrite(&elem, sizeof(json_value), 1, w->f);
+                w->written += sizeof(json_value);
+            }
+            break;
+    }
+}
+
+int snapshot_write(const char *path, const snapshot_key *key, json_value root,
+                   const int *cancel) {
+    size_t tmp_len = strlen(path) + 32;
+    char *tmp = malloc(tmp_len);
+    snprintf(tmp, tmp_len, "%s.%d.tmp", path, (int)getpid());
+    writer w = { .f = fopen(tmp, "wb") };
+    if (!w.f) {
+        free(tmp);
+        return 0;
+    }
+
+    snapshot_header h = {
+        .source_size = key->size,
+        .mtime_sec = key->mtime_sec, .mtime_nsec = key->mtime_nsec,
+        .hash = key->hash, .path_len = strlen(key->path),
+        .value_size = sizeof(json_value)
+    };
+    reserve(&w, sizeof(h) + h.path_len + 1);
+    w.written = w.size;
+    h.root = translate(&w, root, 0);
+    // the magic is only filled in once everything else has been written
+    fwrite(&h, sizeof(h), 1, w.f);
+    fwrite(key->path, 1, h.path_len + 1, w.f);
+    fwrite((char[8]){ 0 }, 1, -(sizeof(h) + h.path_len + 1) & 7, w.f);
+    int cancelled = 0;
+    while (w.head < w.tail && !cancelled) {
+        write_next(&w);
+        cancelled = __atomic_load_n(cancel, __ATOMIC_RELAXED);
+    }
+
+    int ok = !cancelled && !ferror(w.f) && (uint64_t)ftell(w.f) == w.size;
+    if (ok) {
+        memcpy(h.magic, MAGIC, sizeof(h.magic));
+        h.size = w.size;
+        rewind(w.f);
+        fwrite(&h, sizeof(h), 1, w.f);
+        ok = !ferror(w.f);
+    }
+    ok = fclose(w.f) == 0 && ok && rename(tmp, path) == 0;
+    if (!ok)
+        unlink(tmp);
+    free(tmp);
+    free(w.queue);
+    free(w.keys);
+    return ok;
+}
+
+int snapshot_open(const char *path, const snapshot_key *key, snapshot *snap) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    struct stat st;
+    snapshot_header h;
+    char *source_path = NULL;
+    int ok = fstat(fd, &st) == 0 &&
+             pread(fd, &h, sizeof(h), 0) == sizeof(h) &&
+             memcmp(h.magic, MAGIC, sizeof(h.magic)) == 0 &&
+             h.value_size == sizeof(json_value) &&
+             h.size == (uint64_t)st.st_size &&
+             h.source_size == key->size &&
+             h.mtime_sec == key->mtime_sec &&
+             h.mtime_nsec == key->mtime_nsec &&
+             h.hash == key->hash &&
+             h.path_len == strlen(key->path);
+    if (ok) {
+        source_path = malloc(h.path_len + 1);
+        ok = pread(fd, source_path, h.path_len + 1, sizeof(h)) ==
+                 h.path_len + 1 &&
+             memcmp(source_path, key->path, h.path_len + 1) == 0;
+        free(source_path);
+    }
+    if (!ok) {
+        close(fd);
+        return 0;
+    }
+
+    void *data = mmap(NULL, h.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return 0;
+    snap->data = data;
+    snap->size = h.size;
+    snap->root = resolve_child(h.root, data);
+    return 1;
+}
+
+void snapshot_close(snapshot *snap) {
+    if (snap->data)
+        munmap(snap->data, snap->size);
+    snap->data = NULL;
+}
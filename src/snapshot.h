@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include "json.h"
+
+// identifies the version of an input file that a snapshot was taken of
+typedef struct {
+    // absolute
+    char *path;
+    uint64_t size;
+    int64_t mtime_sec, mtime_nsec;
+    // of samples of the contents spread over the whole file
+    uint64_t hash;
+} snapshot_key;
+
+// a parsed document mapped from a snapshot file
+typedef struct {
+    void *data;
+    size_t size;
+    json_value root;
+} snapshot;
+
+// describes the input file filename with the given status, whose contents
+// are sampled from fd; returns 0 if its absolute path cannot be determined
+int mk_snapshot_key(snapshot_key *key, const char *filename,
+                    const struct stat *st, int fd);
+
+void snapshot_key_free(snapshot_key *key);
+
+// where the snapshot of the input file described by key is cached, i.e.
+// $XDG_CACHE_HOME/jinsp/ or ~/.cache/jinsp/; returns NULL if there is no
+// such directory and it cannot be created
+char *snapshot_cache_path(const snapshot_key *key);
+
+// writes root and everything it refers to into a snapshot at path, which is
+// replaced atomically; gives up once *cancel is set; returns 0 on failure
+int snapshot_write(const char *path, const snapshot_key *key, json_value root,
+                   const int *cancel);
+
+// maps the snapshot at path if it was taken of the input file described by
+// key; returns 0 if there is no such snapshot or it is stale
+int snapshot_open(const char *path, const snapshot_key *key, snapshot *snap);
+
+void snapshot_close(snapshot *snap);
@@ -1,19 +1,38 @@
 #include <assert.h>
+#include <inttypes.h>
 #include "json.h"
+#include "parse.h"
+#include "number.h"
 #include "trace.h"
 
-#define STACK_SIZE 128
-
 typedef struct {
     json_value value;
     int index;
 } json_pos;
 
+// grows as needed, so that navigation is not limited in depth; a zeroed
+// json_stack is empty
 typedef struct {
-    json_pos data[STACK_SIZE];
-    int size;
+    json_pos *data;
+    int size, capacity;
 } json_stack;
 
+static inline json_stack mk_stack() {
+    return (json_stack){ 0 };
+}
+
+static inline json_stack stack_copy(const json_stack *stack) {
+    json_stack copy = { malloc(stack->capacity * sizeof(json_pos)),
+                        stack->size, stack->capacity };
+    memcpy(copy.data, stack->data, stack->size * sizeof(json_pos));
+    return copy;
+}
+
+static inline void stack_free(json_stack *stack) {
+    free(stack->data);
+    *stack = mk_stack();
+}
+
 static inline json_pos *stack_peek(json_stack *stack) {
     return &stack->data[stack->size - 1];
 }
@@ -24,11 +43,15 @@ static inline json_pos *stack_peekn(json_stack *stack, int n) {
 }
 
 static inline json_pos stack_pop(json_stack *stack) {
-    return stack->data[stack->size--];
+    return stack->data[--stack->size];
 }
 
 static inline void stack_push(json_stack *stack, json_pos pos) {
-    assert(stack->size < STACK_SIZE);
+    if (stack->size == stack->capacity) {
+        stack->capacity = stack->capacity ? 2 * stack->capacity : 16;
+        stack->data = realloc(stack->data,
+                              stack->capacity * sizeof(json_pos));
+    }
     stack->data[stack->size++] = pos;
 }
 
@@ -44,6 +67,29 @@ static int match(const char *haystack, const char *needle) {
     return strstr(haystack, needle) != NULL;
 }
 
+// like match, for a haystack of len bytes that is not NUL-terminated
+static int match_text(const char *haystack, size_t len, const char *needle) {
+    size_t n = strlen(needle);
+    if (n == 0)
+        return 1;
+    for (const char *p = haystack, *end = haystack + len;
+         (size_t)(end - p) >= n && (p = memchr(p, needle[0], end - p - n + 1)); p++)
+        if (memcmp(p, needle, n) == 0)
+            return 1;
+    return 0;
+}
+
+// matches the text of a string, decoding its escapes first if it has any
+static int match_string(json_value val, const char *needle) {
+    if (!val.escaped)
+        return match_text(string_data(&val), val.size, needle);
+    char *s = malloc(val.size + 1);
+    int res = match_text(s, unescape(string_data(&val), val.size, s),
+                         needle);
+    free(s);
+    return res;
+}
+
 static void traverse_next(json_stack *stack, int rev) {
     stack_pop(stack);
     if (stack->size > 0) {
@@ -56,49 +102,70 @@ static void traverse_next(json_stack *stack, int rev) {
 
 static int first_index(json_value val, int rev) {
     if (rev && val.kind == OBJECT)
-        return object_size(val.object) - 1;
+        return object_size(val) - 1;
     else if (rev && val.kind == ARRAY)
-        return array_size(val.array) - 1;
+        return array_size(val) - 1;
     else
         return 0;
 }
 
+#define KEY_MISSES_SIZE 64
+
+// keys are interned, so those already known not to contain needle are
+// remembered by address in misses
+static int match_key(const char **misses, const char *key,
+                     const char *needle) {
+    const char **slot = &misses[((uintptr_t)key >> 3) % KEY_MISSES_SIZE];
+    if (*slot == key)
+        return 0;
+    if (match(key, needle))
+        return 1;
+    *slot = key;
+    return 0;
+}
+
 // search for str starting from (but not including) position on top of stack, 
 // until either a match has been found or all contents have been popped
 void search(json_stack *stack, const char *str, int rev) {
+    const char *misses[KEY_MISSES_SIZE] = { 0 };
     for (int i = 0; stack->size > 0; i++) {
         trace_stack(stack);
         json_pos *top = stack_peek(stack);
         json_value val = top->value;
         switch (val.kind) {
             case OBJECT:
-                if (top->index >= object_size(val.object) || top->index < 0)
+                if (top->index >= object_size(val) || top->index < 0)
                     traverse_next(stack, rev);
                 else {
-                    json_member next = object_get(val.object, top->index);
+                    json_member next = object_get(val, top->index);
+                    next.val = value_force(next.val);
                     int si = first_index(next.val, rev);
                     stack_push(stack, (json_pos){ next.val, si });
-                    if (i > 0 && match(next.key, str))
+                    if (i > 0 && match_key(misses, next.key, str))
                         return;
                 }
                 break;
             case ARRAY:
-                if (top->index >= array_size(val.array) || top->index < 0)
+                if (top->index >= array_size(val) || top->index < 0)
                     traverse_next(stack, rev);
                 else {
-                    json_value next = array_get(val.array, top->index);
+                    json_value next = value_force(array_get(val, top->index));
                     int si = first_index(next, rev);
                     stack_push(stack, (json_pos){ next, si });
                 }
                 break;
             case STRING:
-                if (i > 0 && match(val.string, str))
+                if (i > 0 && match_string(val, str))
                     return;
                 traverse_next(stack, rev);
                 break;
-            case NUMBER: {
+            case NUMBER:
+            case INTEGER: {
                 char s[32];
-                snprintf(s, 32, "%f", val.number);
+                if (val.kind == NUMBER)
+                    format_number(s, sizeof(s), val.number);
+                else
+                    snprintf(s, sizeof(s), "%" PRId64, val.integer);
                 if (i > 0 && match(s, str))
                     return;
                 traverse_next(stack, rev);
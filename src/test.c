@@ -1,9 +1,20 @@
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
+#include <unistd.h>
 #include "json.h"
 #include "parse.h"
+#include "ndjson.h"
 #include "print.h"
 #include "stack.h"
+#include "index.h"
+#include "number.h"
+#include "snapshot.h"
+#include "decompress.h"
+#include "binary.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <zlib.h>
 
 #ifdef DEBUG
 FILE *trace;
@@ -13,7 +24,7 @@ void parse_round_trip_test(FILE *f) {
     parse_result pr = parse_json(f);
     if (pr.success) {
         //print_json(pr.res);
-        value_free(pr.res);
+        arena_free(pr.arena);
     }
     else {
         print_error(stderr, pr);
@@ -23,7 +34,7 @@ void parse_round_trip_test(FILE *f) {
 void data_struct_test() {
     json_array array = mk_array();
     for (int i = 0; i < 32; i++)
-        array_append(&array, mk_number_value((float)i));
+        array_append(&array, mk_integer_value(i));
     json_object object = mk_object();
     for (int i = 0; i < 10; i++)
         object_append(&object, 
@@ -36,7 +47,7 @@ void data_struct_test() {
 
     s = mk_string(16);
     string_nprintf(&s, 0, "Hello world!\n");
-    assert(s.raw_size == 14 && s.capacity == 32);
+    assert(s.raw_size == 14 && s.capacity == 16);
     assert(strncmp(s.data, "Hello world!\n", s.raw_size) == 0);
     string_clear(&s);
     assert(strncmp(s.data, "", s.raw_size) == 0);
@@ -50,7 +61,7 @@ void data_struct_test() {
     buffer_putchar(&s, '\n');
     buffer_putchar(&s, '\0');
     assert(strncmp(s.data, "Hello world!\n", s.raw_size) == 0);
-    assert(s.raw_size == 14 && s.capacity == 32);
+    assert(s.raw_size == 14 && s.capacity == 16);
     string_nprintf(&s, 0, "Bye bye world!");
     string_nprintf(&s, 0, "%d", 10);
     assert(strncmp(s.data, "Hello world!\nBye bye world!10", s.raw_size) == 0);
@@ -67,15 +78,644 @@ void data_struct_test() {
     assert(strncmp(s.data, "Long strin", s.raw_size) == 0);
     buffer_free(&s);
 
-    json_stack stack;
-    stack.size = 0;
-    stack_push(&stack, (json_pos){mk_string_value("val1"), 1});
-    stack_push(&stack, (json_pos){mk_string_value("val2"), 2});
+    json_stack stack = mk_stack();
+    stack_push(&stack, (json_pos){mk_string_value("val1", 4, 0), 1});
+    stack_push(&stack, (json_pos){mk_string_value("val2", 4, 0), 2});
     assert(stack.size == 2);
     assert(stack_peek(&stack)->index == 2);
     assert(stack_peekn(&stack, 1)->index == 1);
     stack_pop(&stack);
     assert(stack_peek(&stack)->index == 1);
+    for (int i = 0; i < 1000; i++)
+        stack_push(&stack, (json_pos){mk_null_value(), i});
+    json_stack copy = stack_copy(&stack);
+    stack_free(&stack);
+    assert(copy.size == 1001 && stack_peek(&copy)->index == 999);
+    stack_free(&copy);
+}
+
+void nesting_test() {
+    int depth = 10000;
+    buffer s = mk_string(16);
+    for (int i = 0; i < depth; i++)
+        string_nprintf(&s, 0, "{\"a\": [");
+    for (int i = 0; i < depth; i++)
+        string_nprintf(&s, 0, "]}");
+    parse_result pr = parse_json_buf(s.data, s.raw_size - 1);
+    assert(pr.success);
+    json_value v = pr.res;
+    for (int i = 0; i < depth - 1; i++)
+        v = array_get(object_get(v, 0).val, 0);
+    json_value empty = object_get(v, 0).val;
+    assert(array_size(empty) == 0 && !empty.elements);
+    arena_free(pr.arena);
+
+    s.data[s.raw_size - 2] = ']';
+    pr = parse_json_buf(s.data, s.raw_size - 1);
+    assert(!pr.success && pr.error.col == s.raw_size - 1);
+    buffer_free(&s);
+}
+
+void arena_test() {
+    arena *a = mk_arena(), *b = mk_arena();
+    char *s = arena_alloc(a, 5);
+    strcpy(s, "abcd");
+    arena_trim(a, s + 2);
+    char *t = arena_alloc(a, 1);
+    assert(t == s + 8);
+    // larger than a block
+    char *big = arena_alloc(b, 1 << 20);
+    memset(big, 'x', 1 << 20);
+    arena_merge(a, b);
+    assert(strcmp(s, "abcd") == 0 && big[(1 << 20) - 1] == 'x');
+    assert(arena_alloc(a, 8) == t + 8);
+    arena_free(a);
+}
+
+void index_test() {
+    const char *s = "  {\"a\\\"]\\\\\": [1, true ,\"}\"]}";
+    int expected[] = { 2, 3, 11, 13, 14, 15, 17, 22, 23, 26, 27 };
+    int num_expected = sizeof(expected) / sizeof(int);
+    struct_index idx = mk_index();
+    index_build(&idx, s, s + strlen(s));
+    assert(idx.size == num_expected);
+    for (int i = 0; i < num_expected; i++)
+        assert(idx.pos[i] == expected[i]);
+    assert(index_next(&idx, s) == s + 2);
+    assert(index_next(&idx, s + 4) == s + 11);
+    assert(index_next(&idx, s + 28) == s + strlen(s));
+    index_free(&idx);
+}
+
+void lazy_test() {
+    const char *s = "{\"a\": [1, {\"b\": \"]\"}, []], \"c\": {}}";
+    parse_result pr = parse_json_lazy(s, strlen(s));
+    assert(pr.success);
+    json_value a = object_get(pr.res, 0).val;
+    json_value c = object_get(pr.res, 1).val;
+    assert(a.lazy && a.kind == ARRAY && container_size(a) == 3);
+    assert(c.lazy && c.kind == OBJECT && container_size(c) == 0);
+    json_value forced = value_force(a);
+    assert(!forced.lazy && array_size(forced) == 3);
+    assert(array_get(forced, 1).lazy);
+    assert(value_force(a).elements == forced.elements);
+    arena_free(pr.arena);
+}
+
+void parallel_test() {
+    const char *s = " [1, [2, 3], {\"a\": \",\"}, \"4\", 5, 6, 7]\n";
+    parse_result pr = parse_json_parallel(s, strlen(s), 4);
+    assert(pr.success && pr.res.kind == ARRAY);
+    assert(array_size(pr.res) == 7);
+    assert(array_get(pr.res, 2).kind == OBJECT);
+    assert(array_get(pr.res, 6).integer == 7);
+    arena_free(pr.arena);
+
+    pr = parse_json_parallel("[1, 2, 3 4, 5]", 14, 4);
+    assert(!pr.success && pr.error.col == 10);
+    // the closer has to match the opener
+    pr = parse_json_parallel("[1, 2, 3}", 9, 4);
+    assert(!pr.success && pr.error.col == 9);
+    pr = parse_json_parallel("[\"x\"}", 5, 4);
+    assert(!pr.success && pr.error.col == 5);
+}
+
+void intern_test() {
+    const char *s = "[{\"id\": 1, \"n\": 2}, {\"id\": 3, \"\\u006e\": [{\"id\": 4}]}]";
+    parse_result pr = parse_json_lazy(s, strlen(s));
+    assert(pr.success);
+    json_value a = value_force(array_get(pr.res, 0));
+    json_value b = value_force(array_get(pr.res, 1));
+    assert(object_get(a, 0).key == object_get(b, 0).key);
+    assert(object_get(a, 1).key == object_get(b, 1).key);
+    json_value c = array_get(value_force(object_get(b, 1).val), 0);
+    assert(object_get(value_force(c), 0).key == object_get(a, 0).key);
+    arena_free(pr.arena);
+}
+
+void ndjson_test() {
+    const char *s = "{\"id\": 1}\n\n [2, {\"id\": 3}]\r\n\"4\"\n{}\n{\"id\": 5}";
+    parse_result pr = parse_ndjson(s, strlen(s));
+    assert(pr.success && array_size(pr.res) == 5);
+    json_value a = array_get(pr.res, 0);
+    assert(a.lazy == LAZY_RECORD && a.kind == OBJECT);
+    assert(array_get(pr.res, 2).kind == STRING);
+    assert(!array_get(pr.res, 3).lazy && object_size(array_get(pr.res, 3)) == 0);
+    json_value forced = value_force(a);
+    assert(object_size(forced) == 1 && object_get(forced, 0).val.integer == 1);
+    assert(value_force(a).members == forced.members);
+    json_value b = value_force(array_get(pr.res, 1));
+    assert(array_size(b) == 2 && array_get(b, 1).kind == OBJECT);
+    json_value c = value_force(array_get(pr.res, 4));
+    assert(object_get(c, 0).key == object_get(forced, 0).key);
+    ndjson_release(s, strlen(s));
+    arena_free(pr.arena);
+
+    s = "{}\n[1]\ntrue\n\nnul\n";
+    pr = parse_ndjson(s, strlen(s));
+    assert(!pr.success && pr.error.line == 5);
+
+    // lines are appended as the data grows
+    s = "[1]\n2\n{\"id\": 3}\n\n[4]\nnul\n[5]\n";
+    pr = parse_ndjson(s, 4);
+    assert(pr.success && array_size(pr.res) == 1);
+    json_value array = pr.res;
+    assert(ndjson_append(s, 6, &array).success && array_size(array) == 2);
+    assert(ndjson_append(s, 21, &array).success && array_size(array) == 4);
+    assert(array_get(array, 1).integer == 2);
+    assert(object_get(value_force(array_get(array, 2)), 0).val.integer == 3);
+    assert(array_get(value_force(array_get(array, 3)), 0).integer == 4);
+    // a malformed line is reported and skipped
+    parse_result err = ndjson_append(s, strlen(s), &array);
+    assert(!err.success && err.error.line == 6 && array_size(array) == 5);
+    assert(array_get(value_force(array_get(array, 4)), 0).integer == 5);
+    ndjson_release(s, strlen(s));
+    arena_free(pr.arena);
+
+    // a malformed record is only noticed once it is opened
+    s = "[1]\n[2 3]\n";
+    pr = parse_ndjson(s, strlen(s));
+    assert(pr.success && array_size(pr.res) == 2);
+    assert(array_size(value_force(array_get(pr.res, 1))) == 0);
+    ndjson_release(s, strlen(s));
+    arena_free(pr.arena);
+
+    // any number of documents can be open at once
+    char texts[40][16];
+    parse_result docs[40];
+    for (int i = 0; i < 40; i++) {
+        snprintf(texts[i], sizeof(texts[i]), "[%d]\n", i);
+        docs[i] = parse_ndjson(texts[i], strlen(texts[i]));
+        assert(docs[i].success);
+    }
+    for (int i = 0; i < 40; i++) {
+        json_value record = value_force(array_get(docs[i].res, 0));
+        assert(array_get(record, 0).integer == i);
+        ndjson_release(texts[i], strlen(texts[i]));
+        arena_free(docs[i].arena);
+    }
+}
+
+// whether the text of a string, once decoded, is expected
+int string_is(json_value v, const char *expected) {
+    char *s = malloc(v.size + 1);
+    unescape(string_data(&v), v.size, s);
+    int res = v.kind == STRING && strcmp(s, expected) == 0;
+    free(s);
+    return res;
+}
+
+int values_equal(json_value a, json_value b) {
+    if (a.kind != b.kind || a.size != b.size)
+        return 0;
+    switch (a.kind) {
+        case OBJECT:
+            for (unsigned i = 0; i < a.size; i++)
+                if (strcmp(object_get(a, i).key, object_get(b, i).key) != 0 ||
+                    !values_equal(object_get(a, i).val, object_get(b, i).val))
+                    return 0;
+            return 1;
+        case ARRAY:
+            for (unsigned i = 0; i < a.size; i++)
+                if (!values_equal(array_get(a, i), array_get(b, i)))
+                    return 0;
+            return 1;
+        case STRING:
+            return a.size == b.size &&
+                   memcmp(string_data(&a), string_data(&b), a.size) == 0;
+        case NUMBER:
+            return a.number == b.number;
+        case INTEGER:
+            return a.integer == b.integer;
+        default:
+            return 1;
+    }
+}
+
+void snapshot_test() {
+    const char *s = "{\"a\": [1, 2.5, \"x\", {\"a\": {}}], \"b\": [], "
+                    "\"c\": [{\"a\": null, \"b\": true}]}";
+    parse_result pr = parse_json_buf(s, strlen(s));
+    assert(pr.success);
+    snapshot_key key = { .path = "/tmp/input.json", .size = strlen(s),
+                         .mtime_sec = 1, .hash = 2 };
+    char path[] = "/tmp/jinsp_test_XXXXXX";
+    close(mkstemp(path));
+    int cancel = 0;
+    assert(snapshot_write(path, &key, pr.res, &cancel));
+
+    // snapshots can be mapped anywhere, so the same one can be open twice
+    snapshot snap, moved;
+    assert(snapshot_open(path, &key, &snap));
+    assert(snapshot_open(path, &key, &moved));
+    assert(snap.data != moved.data);
+    assert(values_equal(pr.res, snap.root));
+    assert(values_equal(pr.res, moved.root));
+    // keys are still shared
+    json_value c = array_get(object_get(moved.root, 2).val, 0);
+    assert(object_get(c, 0).key == object_get(moved.root, 0).key);
+    snapshot_close(&snap);
+    snapshot_close(&moved);
+
+    key.mtime_nsec = 1;
+    assert(!snapshot_open(path, &key, &snap));
+    unlink(path);
+    arena_free(pr.arena);
+}
+
+// parses the file at path through a decompressor
+parse_result parse_compressed(const char *path, int *ok) {
+    int fd = open(path, O_RDONLY);
+    unsigned char magic[MAGIC_SIZE];
+    ssize_t n = pread(fd, magic, MAGIC_SIZE, 0);
+    assert(detect_compression(magic, n) == GZIP);
+    decompressor *d = decompress_start(fd, GZIP);
+    parse_result pr = parse_json(decompress_output(d));
+    *ok = decompress_finish(d);
+    return pr;
+}
+
+void decompress_test() {
+    char path[] = "/tmp/jinsp_test_XXXXXX";
+    close(mkstemp(path));
+    // two concatenated members
+    gzFile gz = gzopen(path, "wb");
+    gzputs(gz, "[1, ");
+    gzclose(gz);
+    gz = gzopen(path, "ab");
+    for (int i = 0; i < 100000; i++)
+        gzprintf(gz, "\"%d\", ", i);
+    gzputs(gz, "2]");
+    gzclose(gz);
+
+    int ok;
+    parse_result pr = parse_compressed(path, &ok);
+    assert(ok && pr.success && array_size(pr.res) == 100002);
+    assert(string_is(array_get(pr.res, 100000), "99999"));
+    arena_free(pr.arena);
+
+    // without the trailer, the contents are complete but unchecked
+    struct stat st;
+    stat(path, &st);
+    truncate(path, st.st_size - 8);
+    pr = parse_compressed(path, &ok);
+    assert(!ok && pr.success);
+    arena_free(pr.arena);
+    truncate(path, st.st_size / 2);
+    pr = parse_compressed(path, &ok);
+    assert(!ok && !pr.success);
+    unlink(path);
+}
+
+#define READER_TEST_SIZE 1500000
+
+// writes an array spanning several blocks of the reader in small pieces
+void *write_numbers(void *arg) {
+    int fd = *(int *)arg;
+    char piece[4096];
+    for (int i = 0; i < (int)sizeof(piece); i += 2)
+        memcpy(piece + i, "7,", 2);
+    write(fd, "[", 1);
+    for (unsigned n = 0; n < READER_TEST_SIZE - 1; n += sizeof(piece) / 2) {
+        unsigned len = 2 * (READER_TEST_SIZE - 1 - n);
+        write(fd, piece, len < sizeof(piece) ? len : sizeof(piece));
+    }
+    write(fd, "7]", 2);
+    close(fd);
+    return NULL;
+}
+
+void reader_test() {
+    int fds[2];
+    assert(pipe(fds) == 0);
+    reader *r = reader_start(fds[0]);
+    pthread_t writer;
+    pthread_create(&writer, NULL, write_numbers, &fds[1]);
+    parse_result pr = parse_json_progress(NULL, 0, r, NULL);
+    pthread_join(writer, NULL);
+    assert(reader_finish(r));
+    close(fds[0]);
+    assert(pr.success && array_size(pr.res) == READER_TEST_SIZE);
+    assert(array_get(pr.res, READER_TEST_SIZE - 1).integer == 7);
+    arena_free(pr.arena);
+}
+
+void check_test() {
+    const char *s = "{\"a\": [1, \"b\\u00e9\", {\"\\n\": null}], \"c\": true}";
+    size_t consumed;
+    parse_result pr = check_json(s, strlen(s), NULL, &consumed);
+    assert(pr.success && !pr.arena && consumed == strlen(s));
+    s = "[1,\n {\"a\" 2}]";
+    pr = check_json(s, strlen(s), NULL, &consumed);
+    assert(!pr.success && pr.error.line == 2 && pr.error.col == 7);
+    assert(consumed == 10);
+
+    // a stream is checked a window at a time
+    int fds[2];
+    assert(pipe(fds) == 0);
+    reader *r = reader_start(fds[0]);
+    pthread_t writer;
+    pthread_create(&writer, NULL, write_numbers, &fds[1]);
+    pr = check_json(NULL, 0, r, &consumed);
+    pthread_join(writer, NULL);
+    assert(reader_finish(r));
+    close(fds[0]);
+    assert(pr.success && consumed == 2 * READER_TEST_SIZE + 1);
+
+    // and so is a mapped file, whose blocks are dropped behind the parse
+    char path[] = "/tmp/jinsp_test_XXXXXX";
+    int fd = mkstemp(path);
+    write_numbers(&fd);
+    fd = open(path, O_RDONLY);
+    size_t size = 2 * READER_TEST_SIZE + 1;
+    char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    r = reader_map(data, size);
+    pr = check_json(NULL, 0, r, &consumed);
+    assert(reader_finish(r));
+    assert(pr.success && consumed == size);
+    // the dropped pages are read again
+    assert(data[0] == '[' && data[size - 2] == '7');
+    munmap(data, size);
+    close(fd);
+    unlink(path);
+
+    // each line is a document of its own
+    s = "{\"a\": 1}\n\n  [2]\r\n3\n";
+    assert(check_json_lines(s, strlen(s), 1).success);
+    s = "{\"a\": 1}\n[2,\n3]\n";
+    pr = check_json_lines(s, strlen(s), 10);
+    assert(!pr.success && pr.error.line == 11);
+}
+
+void string_test() {
+    const char *s = "0123456789abcdefghijklmnopqrstuvwxyz\\\"\x01";
+    assert(scan_string(s, s + strlen(s)) == s + 36);
+    assert(scan_string(s + 37, s + strlen(s)) == s + 37);
+    assert(scan_string(s + 38, s + strlen(s)) == s + 38);
+    assert(scan_string(s, s + 20) == s + 20);
+
+    s = "[\"a\\\"b\\u00e9\\\\\", \"\", \"plain\"]";
+    parse_result pr = parse_json_buf(s, strlen(s));
+    assert(pr.success);
+    assert(string_is(array_get(pr.res, 0), "a\"b\xc3\xa9\\"));
+    assert(string_is(array_get(pr.res, 1), ""));
+    // strings refer to the input, and are only decoded on demand; short
+    // ones are copied into the value
+    json_value v = array_get(pr.res, 0);
+    assert(v.string == s + 2 && v.size == 12 && v.escaped && !v.embedded);
+    v = array_get(pr.res, 2);
+    assert(v.embedded && v.size == 5 && !v.escaped);
+    assert(memcmp(string_data(&v), "plain", 5) == 0);
+    arena_free(pr.arena);
+
+    // an escape that is cut off is left out
+    char decoded[16];
+    assert(unescape("ab\\u00e9", 5, decoded) == 2);
+    assert(unescape("ab\\n", 4, decoded) == 3 && strcmp(decoded, "ab\n") == 0);
+
+    // streamed strings are copied, escapes included
+    FILE *f = fmemopen((char *)s, strlen(s), "r");
+    pr = parse_json(f);
+    fclose(f);
+    assert(pr.success);
+    v = array_get(pr.res, 0);
+    assert(v.string != s + 2 && v.size == 12 && v.escaped);
+    assert(memcmp(v.string, s + 2, 12) == 0);
+    // short ones need no room of their own
+    v = array_get(pr.res, 2);
+    assert(v.embedded && string_is(v, "plain"));
+    assert(sizeof(json_value) == 16);
+    arena_free(pr.arena);
+
+    pr = parse_json_buf("\"a\\x\"", 5);
+    assert(!pr.success);
+
+    pr = parse_json_buf("\"a\tb\"", 5);
+    assert(!pr.success && pr.error.col == 3);
+}
+
+void error_test() {
+    const char *s = "[1,\n 2,\n  x]";
+    parse_result pr = parse_json_buf(s, strlen(s));
+    assert(!pr.success && pr.error.line == 3 && pr.error.col == 3);
+    assert(pr.error.excerpt_len == 4 && pr.error.excerpt_pos == 2);
+    assert(memcmp(pr.error.excerpt, "  x]", 4) == 0);
+
+    // columns count characters rather than bytes
+    s = "[\"\xc3\xa9\", x]";
+    pr = parse_json_buf(s, strlen(s));
+    assert(!pr.success && pr.error.line == 1 && pr.error.col == 7);
+
+    // lines are counted across the windows of a stream
+    buffer text = mk_buffer(1 << 20);
+    buffer_append(&text, "[", 1);
+    for (int i = 0; i < 100000; i++)
+        buffer_append(&text, "\"\xc3\xa9\",\n", 6);
+    buffer_append(&text, "  1 2]", 6);
+    FILE *f = fmemopen(text.data, text.raw_size, "r");
+    pr = parse_json(f);
+    fclose(f);
+    assert(!pr.success && pr.error.line == 100001 && pr.error.col == 5);
+    assert(memcmp(pr.error.excerpt, "  1 2]", 6) == 0);
+    pr = parse_json_parallel(text.data, text.raw_size, 4);
+    assert(!pr.success && pr.error.line == 100001 && pr.error.col == 5);
+    buffer_free(&text);
+}
+
+void utf8_test() {
+    // overlong, surrogate, beyond U+10FFFF, cut off, stray continuation
+    const char *invalid[] = { "\xc0\xaf", "\xed\xa0\x80", "\xf4\x90\x80\x80",
+                              "\xe2\x82", "\x80" };
+    char text[128];
+    for (int i = 0; i < 5; i++) {
+        // at every offset within a SIMD block
+        for (int off = 0; off < 40; off++) {
+            memset(text, 'a', off);
+            strcpy(text + off, invalid[i]);
+            strcat(text, "\xf0\x9f\x98\x80 b");
+            assert(validate_utf8(text, text + strlen(text)) == text + off);
+        }
+    }
+    const char *s = "\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80\xf4\x8f\xbf\xbf";
+    assert(validate_utf8(s, s + strlen(s)) == s + strlen(s));
+
+    s = "[\"ok\", \"a\xff\"]";
+    parse_result pr = parse_json_buf(s, strlen(s));
+    assert(!pr.success && pr.error.kind == ENCODING_ERROR);
+    assert(pr.error.col == 10 && (unsigned char)pr.error.tok == 0xff);
+    pr = parse_json_buf("{\"\xc3\": 1}", 9);
+    assert(!pr.success && pr.error.kind == ENCODING_ERROR && pr.error.col == 3);
+    // 0xff outside of strings is not the end of input
+    s = "[1,2]\xffgarbage";
+    size_t consumed;
+    pr = check_json(s, strlen(s), NULL, &consumed);
+    assert(!pr.success && pr.error.col == 6 && pr.error.tok == 0xff);
+    pr = parse_json_buf("[1,\xff]", 5);
+    assert(!pr.success && pr.error.col == 4 && pr.error.tok == 0xff);
+    s = "{\"a\":1}\xffgarbage";
+    pr = parse_json_buf(s, strlen(s));
+    assert(!pr.success && pr.error.col == 8 && pr.error.tok == 0xff);
+
+    // surrogate pairs are combined, and unpaired halves replaced
+    s = "[\"\\ud83d\\ude00\", \"\\ud83d\\n\", \"\\ude00\"]";
+    pr = parse_json_buf(s, strlen(s));
+    assert(pr.success);
+    assert(string_is(array_get(pr.res, 0), "\xf0\x9f\x98\x80"));
+    assert(string_is(array_get(pr.res, 1), "\xef\xbf\xbd\n"));
+    assert(string_is(array_get(pr.res, 2), "\xef\xbf\xbd"));
+    arena_free(pr.arena);
+    // a pair that is cut off is left out whole
+    char decoded[16];
+    assert(unescape("a\\ud83d\\ude0", 12, decoded) == 1);
+}
+
+json_value parse_number_str(const char *s) {
+    parse_result pr = parse_json_buf(s, strlen(s));
+    assert(pr.success);
+    return pr.res;
+}
+
+void binary_test() {
+    // self-described CBOR: {"a": [1, -2, 1.5, h'010203', "q\"\n"],
+    // 7: true, "b": [_ (_ "x", "y"), null]}
+    const char cbor[] = "\xd9\xd9\xf7\xa3\x61" "a" "\x85\x01\x21\xf9\x3e\x00"
+                        "\x43\x01\x02\x03\x63q\"\n" "\x07\xf5\x61" "b"
+                        "\x9f\x7f\x61x\x61y\xff\xf6\xff";
+    size_t len = sizeof(cbor) - 1;
+    assert(detect_encoding((const unsigned char *)cbor, len) == CBOR);
+    parse_result pr = parse_binary(cbor, len, CBOR);
+    assert(pr.success && object_size(pr.res) == 3);
+    json_member a = object_get(pr.res, 0);
+    assert(strcmp(a.key, "a") == 0 && array_size(a.val) == 5);
+    assert(array_get(a.val, 0).integer == 1);
+    assert(array_get(a.val, 1).integer == -2);
+    assert(array_get(a.val, 2).number == 1.5);
+    assert(string_is(array_get(a.val, 3), "AQID"));
+    assert(string_is(array_get(a.val, 4), "q\"\n"));
+    assert(strcmp(object_get(pr.res, 1).key, "7") == 0);
+    assert(object_get(pr.res, 1).val.kind == TRUE);
+    json_value b = object_get(pr.res, 2).val;
+    assert(array_size(b) == 2 && string_is(array_get(b, 0), "xy"));
+    assert(array_get(b, 1).kind == NUL);
+    arena_free(pr.arena);
+
+    // MessagePack: {"k": [-1, 300, "\xc3\xa9"], "n": nil}, twice in a row
+    const char msgpack[] = "\x82\xa1k\x93\xff\xcd\x01\x2c\xa2\xc3\xa9\xa1n\xc0"
+                           "\x82\xa1k\x93\xff\xcd\x01\x2c\xa2\xc3\xa9\xa1n\xc0";
+    len = sizeof(msgpack) - 1;
+    assert(detect_encoding((const unsigned char *)msgpack, len) == MSGPACK);
+    pr = parse_binary(msgpack, len, MSGPACK);
+    assert(pr.success && array_size(pr.res) == 2);
+    json_value k = object_get(array_get(pr.res, 1), 0).val;
+    assert(array_get(k, 0).integer == -1 && array_get(k, 1).integer == 300);
+    assert(string_is(array_get(k, 2), "\xc3\xa9"));
+    // keys are interned across the document
+    assert(object_get(array_get(pr.res, 0), 1).key ==
+           object_get(array_get(pr.res, 1), 1).key);
+    arena_free(pr.arena);
+
+    // cut off in the middle of the string
+    pr = parse_binary(msgpack, 9, MSGPACK);
+    assert(!pr.success && pr.error.kind == BINARY_ERROR);
+    assert(pr.error.offset == 9 && pr.error.tok == EOF);
+    // a length beyond the end of input, and invalid UTF-8
+    pr = parse_binary("\x9a\xff\xff\xff\xff\x01", 6, CBOR);
+    assert(!pr.success && pr.error.offset == 6);
+    pr = parse_binary("\x91\xa2\xc3\x28", 4, MSGPACK);
+    assert(!pr.success && pr.error.offset == 2);
+    assert((unsigned char)pr.error.tok == 0xc3);
+    assert(detect_encoding((const unsigned char *)" {", 2) == JSON_TEXT);
+
+    // checking fails where decoding does
+    size_t consumed;
+    pr = check_binary(cbor, sizeof(cbor) - 1, NULL, CBOR, &consumed);
+    assert(pr.success && !pr.arena && consumed == sizeof(cbor) - 1);
+    pr = check_binary(msgpack, 9, NULL, MSGPACK, NULL);
+    assert(!pr.success && pr.error.offset == 9 && pr.error.tok == EOF);
+    pr = check_binary("\x91\xa2\xc3\x28", 4, NULL, MSGPACK, NULL);
+    assert(!pr.success && pr.error.offset == 2);
+
+    // a mapped file is checked a block at a time, with characters cut off
+    // by the end of a block
+    char path[] = "/tmp/jinsp_test_XXXXXX";
+    int fd = mkstemp(path);
+    unsigned count = 10400;
+    char head[5] = { '\xdd', count >> 24, count >> 16, count >> 8, count };
+    write(fd, head, 5);
+    char item[203] = "\xd9\xc9" "a";
+    for (int i = 3; i < 203; i += 2)
+        memcpy(item + i, "\xc3\xa9", 2);
+    for (unsigned i = 0; i < count; i++)
+        write(fd, item, sizeof(item));
+    size_t size = 5 + count * sizeof(item);
+    char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    reader *r = reader_map(data, size);
+    pr = check_binary(NULL, 0, r, MSGPACK, &consumed);
+    assert(reader_finish(r));
+    assert(pr.success && consumed == size);
+    r = reader_map(data, size - 1);
+    pr = check_binary(NULL, 0, r, MSGPACK, &consumed);
+    assert(reader_finish(r));
+    assert(!pr.success && pr.error.offset == size - 1);
+    munmap(data, size);
+    close(fd);
+    unlink(path);
+}
+
+void number_test() {
+    json_value v = parse_number_str("9007199254740993");
+    assert(v.kind == INTEGER && v.integer == 9007199254740993LL);
+    v = parse_number_str("-9223372036854775808");
+    assert(v.kind == INTEGER && v.integer == INT64_MIN);
+    v = parse_number_str("9223372036854775808");
+    assert(v.kind == NUMBER && v.number == 9223372036854775808.0);
+    v = parse_number_str("1.05");
+    assert(v.kind == NUMBER && v.number == 1.05);
+    v = parse_number_str("-0.000123e-2");
+    assert(v.kind == NUMBER && v.number == -0.000123e-2);
+    v = parse_number_str("1e2");
+    assert(v.kind == NUMBER && v.number == 100);
+    v = parse_number_str("2.2250738585072011e-308");
+    assert(v.number == 2.2250738585072011e-308);
+    v = parse_number_str("4.9406564584124654e-324");
+    assert(v.number == 4.9406564584124654e-324);
+    v = parse_number_str("1.7976931348623157e308");
+    assert(v.number == 1.7976931348623157e308);
+    v = parse_number_str("1e400");
+    assert(v.number == HUGE_VAL);
+    // more digits than fit in 64 bits, halfway between two doubles
+    v = parse_number_str("9007199254740993.00000000000000000000001");
+    assert(v.number == 9007199254740994.0);
+    v = parse_number_str("9007199254740993.00000000000000000000000");
+    assert(v.number == 9007199254740992.0);
+    assert(!parse_json_buf("01", 2).success);
+    assert(!parse_json_buf("1.", 2).success);
+    assert(!parse_json_buf("1e+", 3).success);
+
+    char s[32];
+    format_number(s, sizeof(s), 0.1);
+    assert(strcmp(s, "0.1") == 0);
+    format_number(s, sizeof(s), 1.0 / 3);
+    assert(strtod(s, NULL) == 1.0 / 3);
+}
+
+int num_notified;
+
+void count_notify() {
+    num_notified++;
+}
+
+void progress_test() {
+    const char *s = "[1, 2, [3, 4]]";
+    parse_progress progress = { .lock = PTHREAD_MUTEX_INITIALIZER,
+                                .notify = count_notify };
+    parse_result pr = parse_json_progress(s, strlen(s), NULL, &progress);
+    assert(pr.success && progress.done);
+    // once when the array is opened, once per element and once when done
+    assert(num_notified == 5);
+    assert(progress.consumed == strlen(s));
+    assert(progress.root.elements == pr.res.elements);
+    arena_free(pr.arena);
 }
 
 int main() {
@@ -85,6 +725,23 @@ int main() {
 
     parse_round_trip_test(stdin);
     data_struct_test();
+    arena_test();
+    index_test();
+    nesting_test();
+    lazy_test();
+    parallel_test();
+    intern_test();
+    ndjson_test();
+    snapshot_test();
+    decompress_test();
+    reader_test();
+    check_test();
+    string_test();
+    error_test();
+    utf8_test();
+    binary_test();
+    number_test();
+    progress_test();
 
 #ifdef DEBUG
     fclose(trace);